@@ -2,6 +2,7 @@ package soundslide
 
 import (
 	"fmt"
+	"os"
 	"strconv"
 	"strings"
 	"time"
@@ -40,6 +41,18 @@ func NewApp() *cli.App {
 				Action:    setParameter,
 				Args:      true,
 				ArgsUsage: "<" + getParameterKeys() + "> <value>",
+				Flags: []cli.Flag{
+					&cli.BoolFlag{
+						Name:  "no-persist",
+						Usage: "Apply the value without saving it, until commit",
+					},
+					profileFlag(),
+				},
+			},
+			{
+				Name:   "commit",
+				Usage:  "Saves parameters set with --no-persist",
+				Action: commit,
 			},
 			{
 				Name:      "get",
@@ -47,12 +60,78 @@ func NewApp() *cli.App {
 				Action:    getParameter,
 				Args:      true,
 				ArgsUsage: "<" + getParameterKeys() + ">",
+				Flags:     []cli.Flag{profileFlag()},
+			},
+			{
+				Name:  "profile",
+				Usage: "Lists, selects and names parameter profiles",
+				Subcommands: []*cli.Command{
+					{
+						Name:   "list",
+						Usage:  "Lists profiles, the selected one marked",
+						Action: listProfiles,
+					},
+					{
+						Name:      "select",
+						Usage:     "Switches the device to a profile, without saving",
+						Action:    selectProfile,
+						Args:      true,
+						ArgsUsage: "<number|name>",
+					},
+					{
+						Name:      "name",
+						Usage:     "Names a profile, no name clears it",
+						Action:    nameProfile,
+						Args:      true,
+						ArgsUsage: "<number> [name]",
+					},
+				},
+			},
+			{
+				Name:  "config",
+				Usage: "Moves the whole configuration between the device and a file",
+				Subcommands: []*cli.Command{
+					{
+						Name:      "export",
+						Usage:     "Saves the device configuration to a file",
+						Action:    exportConfig,
+						Args:      true,
+						ArgsUsage: "<file>",
+					},
+					{
+						Name:      "import",
+						Usage:     "Loads the device configuration from a file",
+						Action:    importConfig,
+						Args:      true,
+						ArgsUsage: "<file>",
+					},
+				},
 			},
 			{
 				Name:   "defaults",
 				Usage:  "Resets all parameters to default values",
 				Action: setDefaults,
 			},
+			{
+				Name:   "clocks",
+				Usage:  "Shows clock rates measured by the device",
+				Action: showClocks,
+			},
+			{
+				Name:   "cycles",
+				Usage:  "Shows CPU cycles of the touch interrupt and the gesture decoder",
+				Action: showCycles,
+			},
+			{
+				Name:   "events",
+				Usage:  "Shows gesture events merged or dropped on the way to the host, touch frames skipped",
+				Action: showEvents,
+			},
+			{
+				Name:   "wear",
+				Usage:  "Shows flash wear of the stored configuration",
+				Action: showWear,
+			},
 			{
 				Name:      "upgrade",
 				Usage:     "Upgrades the firmware",
@@ -72,6 +151,31 @@ func NewApp() *cli.App {
 	return app
 }
 
+func profileFlag() cli.Flag {
+	return &cli.IntFlag{
+		Name:  "profile",
+		Usage: fmt.Sprintf("Profile 1..%d instead of the selected one", CONFIG_PROFILES),
+	}
+}
+
+// profile by number or name
+func findProfile(device *SoundSlideDevice, profile string) (int, error) {
+	if number, err := strconv.Atoi(profile); err == nil {
+		return number, nil
+	}
+
+	profiles, err := device.GetProfiles()
+	if err != nil {
+		return 0, err
+	}
+	for i, name := range profiles.Names {
+		if name == profile {
+			return i + 1, nil
+		}
+	}
+	return 0, fmt.Errorf("no profile named \"%s\"", profile)
+}
+
 func listDevices(c *cli.Context) error {
 
 	devices, err := ListDevices(c.String("serial"))
@@ -109,9 +213,9 @@ func setParameter(c *cli.Context) error {
 
 	var value uint64
 
-	if key == "function" {
+	if names, ok := ParameterValueNames[key]; ok {
 		found := false
-		for i, v := range DeviceFunctions {
+		for i, v := range names {
 			if v == valueStr {
 				value = uint64(i)
 				found = true
@@ -119,7 +223,7 @@ func setParameter(c *cli.Context) error {
 			}
 		}
 		if !found {
-			return fmt.Errorf("value \"%v\" is not a valid function, valid functions are: %s", valueStr, strings.Join(DeviceFunctions, ", "))
+			return fmt.Errorf("value \"%v\" is not a valid %s, valid values are: %s", valueStr, key, strings.Join(names, ", "))
 		}
 	} else {
 		value, err = strconv.ParseUint(valueStr, 10, 8)
@@ -128,7 +232,7 @@ func setParameter(c *cli.Context) error {
 		}
 	}
 
-	err = device.SetParameter(key, uint8(value))
+	err = device.SetParameter(key, c.Int("profile"), uint8(value), !c.Bool("no-persist"))
 	if err != nil {
 		return fmt.Errorf("error setting parameter: %v", err)
 	}
@@ -148,16 +252,16 @@ func getParameter(c *cli.Context) error {
 		return fmt.Errorf("key is required, valid keys are: %s", getParameterKeys())
 	}
 
-	value, err := device.GetParameter(key)
+	value, err := device.GetParameter(key, c.Int("profile"))
 	if err != nil {
 		return fmt.Errorf("error getting parameter: %v", err)
 	}
 
-	if key == "function" {
-		if int(value) < len(DeviceFunctions) {
-			fmt.Println(DeviceFunctions[value])
+	if names, ok := ParameterValueNames[key]; ok {
+		if int(value) < len(names) {
+			fmt.Println(names[value])
 		} else {
-			return fmt.Errorf("unknown function value: %d", value)
+			return fmt.Errorf("unknown %s value: %d", key, value)
 		}
 	} else {
 		fmt.Println(value)
@@ -165,6 +269,137 @@ func getParameter(c *cli.Context) error {
 	return nil
 }
 
+func commit(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	err = device.Commit()
+	if err != nil {
+		return fmt.Errorf("error committing parameters: %v", err)
+	}
+
+	return nil
+}
+
+func listProfiles(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	profiles, err := device.GetProfiles()
+	if err != nil {
+		return fmt.Errorf("error getting profiles: %v", err)
+	}
+
+	for i, name := range profiles.Names {
+		mark := " "
+		if i+1 == profiles.Selected {
+			mark = "*"
+		}
+		fmt.Printf("%s %d %s\n", mark, i+1, name)
+	}
+	return nil
+}
+
+func selectProfile(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	if c.Args().Get(0) == "" {
+		return fmt.Errorf("profile number or name is required")
+	}
+
+	profile, err := findProfile(device, c.Args().Get(0))
+	if err != nil {
+		return err
+	}
+
+	err = device.SelectProfile(profile)
+	if err != nil {
+		return fmt.Errorf("error selecting profile: %v", err)
+	}
+
+	return nil
+}
+
+func nameProfile(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	profile, err := strconv.Atoi(c.Args().Get(0))
+	if err != nil {
+		return fmt.Errorf("profile number is required")
+	}
+
+	err = device.SetProfileName(profile, c.Args().Get(1))
+	if err != nil {
+		return fmt.Errorf("error naming profile: %v", err)
+	}
+
+	return nil
+}
+
+func exportConfig(c *cli.Context) error {
+
+	file := c.Args().Get(0)
+	if file == "" {
+		return fmt.Errorf("file name is required")
+	}
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	block, err := device.ExportConfig()
+	if err != nil {
+		return fmt.Errorf("error reading configuration: %v", err)
+	}
+
+	err = os.WriteFile(file, block, 0644)
+	if err != nil {
+		return fmt.Errorf("error writing file: %v", err)
+	}
+
+	return nil
+}
+
+func importConfig(c *cli.Context) error {
+
+	file := c.Args().Get(0)
+	if file == "" {
+		return fmt.Errorf("file name is required")
+	}
+
+	block, err := os.ReadFile(file)
+	if err != nil {
+		return fmt.Errorf("error reading file: %v", err)
+	}
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	err = device.ImportConfig(block)
+	if err != nil {
+		return fmt.Errorf("error writing configuration: %v", err)
+	}
+
+	return nil
+}
+
 func setDefaults(c *cli.Context) error {
 
 	device, err := OpenDevice(c.String("serial"))
@@ -180,6 +415,83 @@ func setDefaults(c *cli.Context) error {
 	return nil
 }
 
+func showClocks(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	clocks, err := device.GetClocks()
+	if err != nil {
+		return fmt.Errorf("error getting clocks: %v", err)
+	}
+
+	if !clocks.Measured {
+		return fmt.Errorf("not measured yet, try again in a second")
+	}
+
+	locked := "not locked"
+	if clocks.Locked {
+		locked = "locked"
+	}
+	fmt.Printf("CPU %d Hz (%s to USB)\n", clocks.CpuHz, locked)
+	fmt.Printf("timebase %d Hz\n", clocks.TimebaseHz)
+	fmt.Printf("touch frames %d.%03d Hz\n", clocks.TouchFrameMilliHz/1000, clocks.TouchFrameMilliHz%1000)
+	return nil
+}
+
+func showCycles(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	cycles, err := device.GetCycles()
+	if err != nil {
+		return fmt.Errorf("error getting cycles: %v", err)
+	}
+
+	fmt.Printf("touch interrupt %d to %d cycles\n", cycles.TouchIsrMin, cycles.TouchIsrMax)
+	fmt.Printf("frame decode %d to %d cycles\n", cycles.DecodeMin, cycles.DecodeMax)
+	return nil
+}
+
+func showEvents(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	events, err := device.GetEvents()
+	if err != nil {
+		return fmt.Errorf("error getting events: %v", err)
+	}
+
+	fmt.Printf("merged into a pending report %d\n", events.Coalesced)
+	fmt.Printf("dropped, key queue full %d\n", events.Dropped)
+	fmt.Printf("touch frames not decoded %d\n", events.FramesMissed)
+	return nil
+}
+
+func showWear(c *cli.Context) error {
+
+	device, err := OpenDevice(c.String("serial"))
+	if err != nil {
+		return fmt.Errorf("error opening device: %v", err)
+	}
+
+	wear, err := device.GetConfigWear()
+	if err != nil {
+		return fmt.Errorf("error getting wear: %v", err)
+	}
+
+	fmt.Printf("config row erased %d times, %d of %d records used\n", wear.Erases, wear.Records, PAGES_PER_ROW)
+	return nil
+}
+
 func upgradeFirmware(c *cli.Context) error {
 
 	imageFile := c.Args().Get(0)
@@ -195,6 +507,7 @@ func upgradeFirmware(c *cli.Context) error {
 
 	showProgress := !c.Bool("progress")
 
+	started := time.Now()
 	err = device.UpgradeFirmware(imageFile, func(pagesWritten, totalPages int) {
 		if showProgress {
 			fmt.Printf("\r%d%% done", 100*pagesWritten/totalPages)
@@ -203,6 +516,7 @@ func upgradeFirmware(c *cli.Context) error {
 	if err != nil {
 		return fmt.Errorf("error upgrading firmware: %v", err)
 	}
+	fmt.Printf("image uploaded in %v\n", time.Since(started).Round(time.Millisecond))
 
 	if err != nil {
 		return fmt.Errorf("error closing device: %v", err)
@@ -219,6 +533,13 @@ func upgradeFirmware(c *cli.Context) error {
 		}
 		defer device2.Close()
 		fmt.Printf("%s version %d.%d.%d\n", device2.SerialNumber, device2.Version.Major, device2.Version.Minor, device2.Version.Patch)
+		statistics, err := device2.GetInstallStatistics()
+		if err == nil {
+			fmt.Printf("rows erased %d, skipped %d, retried %d, failed %d\n", statistics.RowsErased, statistics.RowsSkipped, statistics.RowsRetried, statistics.RowsFailed)
+			if statistics.RowsFailed > 0 {
+				return fmt.Errorf("flash verification failed")
+			}
+		}
 		break
 	}
 
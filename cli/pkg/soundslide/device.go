@@ -1,7 +1,9 @@
 package soundslide
 
 import (
+	"encoding/binary"
 	"fmt"
+	"hash/crc32"
 	"os"
 	"strings"
 
@@ -11,19 +13,53 @@ import (
 // keep in sync with usb-cfg.cpp
 const (
 	CFG_REQUEST_GET_STATUS = 0x01 // IN,  data: bytes [patch version high byte, patch version low byte]
+	CFG_REQUEST_GET_CLOCKS = 0x02 // IN,  data: flags (bit 0 measured, bit 1 DFLL locked to USB), big-endian uint32 CPU Hz, timebase Hz, touch frame rate mHz
+	CFG_REQUEST_GET_CYCLES = 0x03 // IN,  data: big-endian uint32 CPU cycles of the touch interrupt and of a frame decode, min and max each
+	CFG_REQUEST_GET_EVENTS = 0x04 // IN,  data: big-endian uint32 gesture events merged into a pending report, dropped with the key queue full, touch frames never decoded
 
 	CFG_REQUEST_SET_PARAMETER = 0x10 // OUT, wValue low byte: parameter key, wValue high byte: parameter value
+	//                                  key high nibble: 0 selected profile, or profile + 1
 	CFG_REQUEST_GET_PARAMETER = 0x11 // IN,  wValue low byte: parameter key, data: parameter value (one byte)
 	CFG_REQUEST_SET_DEFAULTS  = 0x12 // OUT, data: none
+	CFG_REQUEST_GET_WEAR      = 0x13 // IN,  data: big-endian uint32 config row erases, records in the row (one byte)
+	CFG_REQUEST_TRY_PARAMETER = 0x14 // OUT, as CFG_REQUEST_SET_PARAMETER, but not saved until CFG_REQUEST_COMMIT
+	CFG_REQUEST_COMMIT        = 0x15 // OUT, saves changes not saved yet now, data: none
+	CFG_REQUEST_GET_CONFIG    = 0x16 // IN,  data: configuration block, version byte and all parameters
+	CFG_REQUEST_SET_CONFIG    = 0x17 // OUT, data: configuration block, applied and saved at once; stall if its version differs
 
-	CFG_REQUEST_IMG_PREPARE = 0x20 // OUT, wValue: image size in pages
-	CFG_REQUEST_IMG_INSTALL = 0x21 // OUT, data: CRC32 of the image as big-endian uint32
+	CFG_REQUEST_SELECT_PROFILE   = 0x18 // OUT, wValue: profile, applied at once and not saved
+	CFG_REQUEST_GET_PROFILES     = 0x19 // IN,  data: selected profile, names of all profiles, CONFIG_PROFILE_NAME_SIZE bytes each, zero padded
+	CFG_REQUEST_SET_PROFILE_NAME = 0x1A // OUT, wValue: profile, data: none or name of up to CONFIG_PROFILE_NAME_SIZE bytes
+
+	CFG_REQUEST_IMG_PREPARE = 0x20 // OUT, wValue: image size in pages, data: none or image tag as big-endian uint32
+	CFG_REQUEST_IMG_INSTALL = 0x21 // OUT, data: CRC32 of the image as big-endian uint32, or no data and wValue: XOR CRC16 (firmware before 1.1)
+
+	CFG_REQUEST_IMG_PREPARE_COMPRESSED = 0x22 // OUT, wValue: decompressed image size in pages, image follows LZ compressed (lz.go)
+	CFG_REQUEST_IMG_STATISTICS         = 0x23 // IN,  data: big-endian uint16 rows erased, skipped, retried, failed by the last install; stall if none
+	CFG_REQUEST_IMG_STATUS             = 0x24 // IN,  data: big-endian uint16 image size in pages, big-endian uint32 image tag, receipt bitmap, bit per page lowest first
+	CFG_REQUEST_IMG_SEEK               = 0x25 // OUT, wValue: first page of a row, raw pages sent next go there
 
 	INTERFACE_STATE_IDLE       = 0
 	INTERFACE_STATE_UPLOADING  = 1
 	INTERFACE_STATE_INSTALLING = 2
 
-	PAGE_SIZE = 64
+	PAGE_SIZE         = 64
+	PAGES_PER_ROW     = 4
+	FWU_RECEIPT_BYTES = 16 // upload area of 124 pages
+
+	// bulk writes kept in flight during an upgrade; the device buffers two
+	// pages while flash is programmed and NAKs the rest until it catches up
+	FWU_WRITES_IN_FLIGHT = 4
+
+	// rounds of resending missing rows before giving up
+	FWU_TOP_UP_ROUNDS = 3
+
+	// configuration block: version byte and parameters, sent in a single packet
+	CONFIG_BLOCK_VERSION  = 1
+	CONFIG_BLOCK_MAX_SIZE = 64
+
+	CONFIG_PROFILES          = 4
+	CONFIG_PROFILE_NAME_SIZE = 7
 )
 
 var DeviceParameters map[string]uint8 = map[string]uint8{
@@ -31,6 +67,7 @@ var DeviceParameters map[string]uint8 = map[string]uint8{
 	"scale":       1,
 	"sensitivity": 2,
 	"function":    3,
+	"volume":      4,
 }
 
 var DeviceFunctions []string = []string{
@@ -39,6 +76,17 @@ var DeviceFunctions []string = []string{
 	"brightness",
 }
 
+var VolumeModes []string = []string{
+	"keys",
+	"linear",
+}
+
+// parameters with named values, the value is the index of the name
+var ParameterValueNames map[string][]string = map[string][]string{
+	"function": DeviceFunctions,
+	"volume":   VolumeModes,
+}
+
 type SoundSlideDevice struct {
 	usbDevice   *gousb.Device
 	fwuEndpoint *gousb.OutEndpoint
@@ -55,6 +103,89 @@ type Status struct {
 	PatchVersion int
 }
 
+// staged image on the device
+type UploadStatus struct {
+	Pages    int
+	Tag      uint32 // CRC32 of the image, given with prepare
+	Received []bool // page programmed and valid
+}
+
+func (s UploadStatus) pagesReceived() int {
+	count := 0
+	for _, received := range s.Received {
+		if received {
+			count++
+		}
+	}
+	return count
+}
+
+// missingRuns returns [first, end) page ranges of whole rows with pages missing,
+// the device erases a row when its first page is written
+func (s UploadStatus) missingRuns() [][2]int {
+	var runs [][2]int
+	for row := 0; row < s.Pages; row += PAGES_PER_ROW {
+		missing := false
+		for page := row; page < row+PAGES_PER_ROW && page < s.Pages; page++ {
+			missing = missing || !s.Received[page]
+		}
+		if !missing {
+			continue
+		}
+		if len(runs) > 0 && runs[len(runs)-1][1] == row {
+			runs[len(runs)-1][1] = row + PAGES_PER_ROW
+		} else {
+			runs = append(runs, [2]int{row, row + PAGES_PER_ROW})
+		}
+	}
+	return runs
+}
+
+// what the install that started the running firmware did to flash, in rows
+type InstallStatistics struct {
+	RowsErased  int
+	RowsSkipped int
+	RowsRetried int
+	RowsFailed  int
+}
+
+// clock rates the device measured against the USB frames after boot
+type Clocks struct {
+	Measured          bool
+	Locked            bool // CPU clock locked to the USB frames
+	CpuHz             int
+	TimebaseHz        int
+	TouchFrameMilliHz int
+}
+
+// CPU cycles the device measured with SysTick since boot, 0 before the first run
+type Cycles struct {
+	TouchIsrMin int
+	TouchIsrMax int
+	DecodeMin   int
+	DecodeMax   int
+}
+
+// gesture events the device handled without a report of their own and touch frames it skipped, since boot
+type Events struct {
+	Coalesced    int // merged into a report not sent yet
+	Dropped      int // lost, the key queue was full
+	FramesMissed int // published by the sensor but never decoded
+}
+
+// profiles are numbered from 1 here, from 0 on the wire
+type Profiles struct {
+	Selected int
+	Names    []string // empty if not named
+}
+
+// flash wear of the configuration row, a record is appended per save and
+// the row is erased when all of its pages hold one
+type ConfigWear struct {
+	Erases  int
+	Records int
+}
+
 func ListDevices(onlySerialNumber string) ([]SoundSlideDevice, error) {
 	ctx := gousb.NewContext()
 	defer ctx.Close()
@@ -162,6 +293,22 @@ func (d SoundSlideDevice) configInterfaceRequestIn(bRequest uint8, wValue uint16
 	return data, nil
 }
 
+// for replies of varying length, up to maxLength
+func (d SoundSlideDevice) configInterfaceRequestInUpTo(bRequest uint8, wValue uint16, maxLength int) ([]byte, error) {
+	data := make([]byte, maxLength)
+	read, err := d.usbDevice.Control(
+		gousb.ControlIn|gousb.ControlVendor|gousb.ControlInterface, // bmRequestType
+		bRequest, // bRequest
+		wValue,   // wValue
+		0x0001,   // wIndex
+		data)
+	if err != nil {
+		return nil, fmt.Errorf("error issuing control request: %v", err)
+	}
+
+	return data[:read], nil
+}
+
 func (d SoundSlideDevice) configInterfaceRequestOut(bRequest uint8, wValue uint16) error {
 	_, err := d.usbDevice.Control(
 		gousb.ControlOut|gousb.ControlVendor|gousb.ControlInterface, // bmRequestType
@@ -176,6 +323,25 @@ func (d SoundSlideDevice) configInterfaceRequestOut(bRequest uint8, wValue uint1
 	return nil
 }
 
+func (d SoundSlideDevice) configInterfaceRequestOutData(bRequest uint8, wValue uint16, data []byte) error {
+	_, err := d.usbDevice.Control(
+		gousb.ControlOut|gousb.ControlVendor|gousb.ControlInterface, // bmRequestType
+		bRequest, // bRequest
+		wValue,   // wValue
+		0x0001,   // wIndex
+		data)
+	if err != nil {
+		return fmt.Errorf("error issuing control request: %v", err)
+	}
+
+	return nil
+}
+
+// firmware 1.1 and newer check the image with the hardware CRC32 and take it compressed
+func (d SoundSlideDevice) versionAtLeast(major int, minor int) bool {
+	return d.Version.Major > major || d.Version.Major == major && d.Version.Minor >= minor
+}
+
 func (d SoundSlideDevice) Close() {
 	d.usbDevice.Close()
 }
@@ -192,13 +358,154 @@ func (d SoundSlideDevice) GetStatus() (Status, error) {
 	}, nil
 }
 
-func (d SoundSlideDevice) SetParameter(key string, value uint8) error {
+func (d SoundSlideDevice) GetClocks() (Clocks, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return Clocks{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_GET_CLOCKS, 0, 13)
+	if err != nil {
+		return Clocks{}, err
+	}
+
+	return Clocks{
+		Measured:          data[0]&1 != 0,
+		Locked:            data[0]&2 != 0,
+		CpuHz:             int(binary.BigEndian.Uint32(data[1:])),
+		TimebaseHz:        int(binary.BigEndian.Uint32(data[5:])),
+		TouchFrameMilliHz: int(binary.BigEndian.Uint32(data[9:])),
+	}, nil
+}
+
+func (d SoundSlideDevice) GetCycles() (Cycles, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return Cycles{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_GET_CYCLES, 0, 16)
+	if err != nil {
+		return Cycles{}, err
+	}
+
+	return Cycles{
+		TouchIsrMin: int(binary.BigEndian.Uint32(data[0:])),
+		TouchIsrMax: int(binary.BigEndian.Uint32(data[4:])),
+		DecodeMin:   int(binary.BigEndian.Uint32(data[8:])),
+		DecodeMax:   int(binary.BigEndian.Uint32(data[12:])),
+	}, nil
+}
+
+func (d SoundSlideDevice) GetEvents() (Events, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return Events{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_GET_EVENTS, 0, 12)
+	if err != nil {
+		return Events{}, err
+	}
+
+	return Events{
+		Coalesced:    int(binary.BigEndian.Uint32(data[0:])),
+		Dropped:      int(binary.BigEndian.Uint32(data[4:])),
+		FramesMissed: int(binary.BigEndian.Uint32(data[8:])),
+	}, nil
+}
+
+// only firmware 1.1 and newer started by an install has statistics
+func (d SoundSlideDevice) GetInstallStatistics() (InstallStatistics, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return InstallStatistics{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_IMG_STATISTICS, 0, 8)
+	if err != nil {
+		return InstallStatistics{}, err
+	}
+
+	return InstallStatistics{
+		RowsErased:  int(binary.BigEndian.Uint16(data[0:])),
+		RowsSkipped: int(binary.BigEndian.Uint16(data[2:])),
+		RowsRetried: int(binary.BigEndian.Uint16(data[4:])),
+		RowsFailed:  int(binary.BigEndian.Uint16(data[6:])),
+	}, nil
+}
+
+func (d SoundSlideDevice) GetConfigWear() (ConfigWear, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return ConfigWear{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_GET_WEAR, 0, 5)
+	if err != nil {
+		return ConfigWear{}, err
+	}
+
+	return ConfigWear{
+		Erases:  int(binary.BigEndian.Uint32(data[0:])),
+		Records: int(data[4]),
+	}, nil
+}
+
+func (d SoundSlideDevice) GetUploadStatus() (UploadStatus, error) {
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_IMG_STATUS, 0, 6+FWU_RECEIPT_BYTES)
+	if err != nil {
+		return UploadStatus{}, err
+	}
+
+	status := UploadStatus{
+		Pages:    int(binary.BigEndian.Uint16(data[0:])),
+		Tag:      binary.BigEndian.Uint32(data[2:]),
+		Received: make([]bool, int(binary.BigEndian.Uint16(data[0:]))),
+	}
+	for page := range status.Received {
+		status.Received[page] = data[6+page/8]&(1<<(page%8)) != 0
+	}
+
+	return status, nil
+}
+
+// parameter key of a profile, or of the selected one if profile is 0
+func (d SoundSlideDevice) profileParamKey(key string, profile int) (uint8, error) {
 	keyIndex, err := paramKeyToInt(key)
+	if err != nil {
+		return 0, err
+	}
+	if profile == 0 {
+		return keyIndex, nil
+	}
+	if !d.versionAtLeast(1, 1) {
+		return 0, fmt.Errorf("profiles not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+	if profile < 0 || profile > CONFIG_PROFILES {
+		return 0, fmt.Errorf("profile %d out of range 1..%d", profile, CONFIG_PROFILES)
+	}
+	return keyIndex | uint8(profile)<<4, nil
+}
+
+// the device saves the change a moment after the last one, or with persist
+// false only on Commit; profile 0 is the selected one
+func (d SoundSlideDevice) SetParameter(key string, profile int, value uint8, persist bool) error {
+	keyIndex, err := d.profileParamKey(key, profile)
 	if err != nil {
 		return err
 	}
 
-	err = d.configInterfaceRequestOut(CFG_REQUEST_SET_PARAMETER, uint16(value)<<8|uint16(keyIndex))
+	var request uint8 = CFG_REQUEST_SET_PARAMETER
+	if !persist {
+		if !d.versionAtLeast(1, 1) {
+			return fmt.Errorf("changes without saving not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+		}
+		request = CFG_REQUEST_TRY_PARAMETER
+	}
+
+	err = d.configInterfaceRequestOut(request, uint16(value)<<8|uint16(keyIndex))
 	if err != nil {
 		return err
 	}
@@ -206,9 +513,9 @@ func (d SoundSlideDevice) SetParameter(key string, value uint8) error {
 	return nil
 }
 
-func (d SoundSlideDevice) GetParameter(key string) (uint8, error) {
+func (d SoundSlideDevice) GetParameter(key string, profile int) (uint8, error) {
 
-	keyIndex, err := paramKeyToInt(key)
+	keyIndex, err := d.profileParamKey(key, profile)
 	if err != nil {
 		return 0, err
 	}
@@ -221,6 +528,128 @@ func (d SoundSlideDevice) GetParameter(key string) (uint8, error) {
 	return data[0], nil
 }
 
+// saves changes made without persist, and any not saved yet, at once
+func (d SoundSlideDevice) Commit() error {
+
+	if !d.versionAtLeast(1, 1) {
+		return fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	err := d.configInterfaceRequestOut(CFG_REQUEST_COMMIT, 0)
+	if err != nil {
+		return err
+	}
+
+	return nil
+}
+
+func (d SoundSlideDevice) GetProfiles() (Profiles, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return Profiles{}, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	data, err := d.configInterfaceRequestIn(CFG_REQUEST_GET_PROFILES, 0, 1+CONFIG_PROFILES*CONFIG_PROFILE_NAME_SIZE)
+	if err != nil {
+		return Profiles{}, err
+	}
+
+	profiles := Profiles{
+		Selected: int(data[0]) + 1,
+		Names:    make([]string, CONFIG_PROFILES),
+	}
+	for i := range profiles.Names {
+		name := data[1+i*CONFIG_PROFILE_NAME_SIZE : 1+(i+1)*CONFIG_PROFILE_NAME_SIZE]
+		profiles.Names[i] = strings.TrimRight(string(name), "\x00")
+	}
+
+	return profiles, nil
+}
+
+// switches the device to a profile at once, without saving it
+func (d SoundSlideDevice) SelectProfile(profile int) error {
+
+	if !d.versionAtLeast(1, 1) {
+		return fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+	if profile < 1 || profile > CONFIG_PROFILES {
+		return fmt.Errorf("profile %d out of range 1..%d", profile, CONFIG_PROFILES)
+	}
+
+	err := d.configInterfaceRequestOut(CFG_REQUEST_SELECT_PROFILE, uint16(profile-1))
+	if err != nil {
+		return err
+	}
+
+	return nil
+}
+
+func (d SoundSlideDevice) SetProfileName(profile int, name string) error {
+
+	if !d.versionAtLeast(1, 1) {
+		return fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+	if profile < 1 || profile > CONFIG_PROFILES {
+		return fmt.Errorf("profile %d out of range 1..%d", profile, CONFIG_PROFILES)
+	}
+	if len(name) > CONFIG_PROFILE_NAME_SIZE {
+		return fmt.Errorf("profile name \"%s\" longer than %d bytes", name, CONFIG_PROFILE_NAME_SIZE)
+	}
+
+	var err error
+	if name == "" {
+		err = d.configInterfaceRequestOut(CFG_REQUEST_SET_PROFILE_NAME, uint16(profile-1))
+	} else {
+		err = d.configInterfaceRequestOutData(CFG_REQUEST_SET_PROFILE_NAME, uint16(profile-1), []byte(name))
+	}
+	if err != nil {
+		return err
+	}
+
+	return nil
+}
+
+// whole configuration as one block, for ImportConfig
+func (d SoundSlideDevice) ExportConfig() ([]byte, error) {
+
+	if !d.versionAtLeast(1, 1) {
+		return nil, fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	block, err := d.configInterfaceRequestInUpTo(CFG_REQUEST_GET_CONFIG, 0, CONFIG_BLOCK_MAX_SIZE)
+	if err != nil {
+		return nil, err
+	}
+	if len(block) == 0 {
+		return nil, fmt.Errorf("empty configuration block")
+	}
+
+	return block, nil
+}
+
+// applies and saves a block from ExportConfig; parameters the block lacks
+// keep their values on the device, ones the device lacks are ignored
+func (d SoundSlideDevice) ImportConfig(block []byte) error {
+
+	if !d.versionAtLeast(1, 1) {
+		return fmt.Errorf("not supported by firmware %d.%d", d.Version.Major, d.Version.Minor)
+	}
+
+	if len(block) == 0 || len(block) > CONFIG_BLOCK_MAX_SIZE {
+		return fmt.Errorf("configuration block of %d bytes, expected 1 to %d", len(block), CONFIG_BLOCK_MAX_SIZE)
+	}
+	if block[0] != CONFIG_BLOCK_VERSION {
+		return fmt.Errorf("configuration block version %d, expected %d", block[0], CONFIG_BLOCK_VERSION)
+	}
+
+	err := d.configInterfaceRequestOutData(CFG_REQUEST_SET_CONFIG, 0, block)
+	if err != nil {
+		return err
+	}
+
+	return nil
+}
+
 func (d SoundSlideDevice) SetDefaults() error {
 
 	err := d.configInterfaceRequestOut(CFG_REQUEST_SET_DEFAULTS, 0)
@@ -257,34 +686,152 @@ func (d SoundSlideDevice) UpgradeFirmware(imageFile string, progressMonitor func
 	}
 
 	pages := len(data) / PAGE_SIZE
-	progressMonitor(0, pages)
+	imageCrc32 := crc32.ChecksumIEEE(data)
+
+	// firmware 1.1 and newer keep an interrupted upload of the same image, tagged with its CRC32
+	resume := false
+	if d.versionAtLeast(1, 1) {
+		status, err := d.GetUploadStatus()
+		if err == nil && status.Pages == pages && status.Tag == imageCrc32 {
+			resume = true
+			fmt.Printf("resuming upload, %d of %d pages on the device\n", status.pagesReceived(), pages)
+		}
+	}
 
-	err := d.configInterfaceRequestOut(CFG_REQUEST_IMG_PREPARE, uint16(pages))
-	if err != nil {
-		return fmt.Errorf("error preparing image: %v", err)
+	if !resume {
+		err := d.uploadImage(data, imageCrc32, progressMonitor)
+		if err != nil {
+			return err
+		}
 	}
 
-	for i := 0; i < pages; i++ {
-		written, err := d.fwuEndpoint.Write(data[i*PAGE_SIZE : (i+1)*PAGE_SIZE])
+	if d.versionAtLeast(1, 1) {
+		err := d.topUpImage(data)
 		if err != nil {
-			return fmt.Errorf("error writing image: %v", err)
+			return err
 		}
-		if written != PAGE_SIZE {
-			return fmt.Errorf("short write")
+	}
+
+	var err error
+	if d.versionAtLeast(1, 1) {
+		crc := make([]byte, 4)
+		binary.BigEndian.PutUint32(crc, imageCrc32)
+		err = d.configInterfaceRequestOutData(CFG_REQUEST_IMG_INSTALL, 0, crc)
+	} else {
+		var crc16 uint16 = 0x1234
+		for i := 0; i < len(data); i += 2 {
+			crc16 ^= uint16(data[i]) | uint16(data[i+1])<<8
+		}
+		err = d.configInterfaceRequestOut(CFG_REQUEST_IMG_INSTALL, crc16)
+	}
+	if err != nil {
+		return fmt.Errorf("error installing image: %v", err)
+	}
+
+	return nil
+}
+
+// uploadImage prepares the device for a new image and sends all of it
+func (d SoundSlideDevice) uploadImage(data []byte, imageCrc32 uint32, progressMonitor func(int, int)) error {
+
+	pages := len(data) / PAGE_SIZE
+
+	upload := data
+	var prepareRequest uint8 = CFG_REQUEST_IMG_PREPARE
+	if d.versionAtLeast(1, 1) {
+		compressed := lzCompress(data)
+		if len(compressed) < len(data) {
+			upload = compressed
+			prepareRequest = CFG_REQUEST_IMG_PREPARE_COMPRESSED
+			fmt.Printf("image compressed from %d to %d bytes (%.0f%%)\n", len(data), len(compressed), 100*float64(len(compressed))/float64(len(data)))
 		}
-		progressMonitor(i+1, pages)
 	}
 
-	var crc16 uint16 = 0x1234
-	for i := 0; i < len(data); i += 2 {
-		crc16 ^= uint16(data[i]) | uint16(data[i+1])<<8
+	// the compressed stream may end with a short packet
+	packets := (len(upload) + PAGE_SIZE - 1) / PAGE_SIZE
+	progressMonitor(0, packets)
+
+	var err error
+	if d.versionAtLeast(1, 1) {
+		tag := make([]byte, 4)
+		binary.BigEndian.PutUint32(tag, imageCrc32)
+		err = d.configInterfaceRequestOutData(prepareRequest, uint16(pages), tag)
+	} else {
+		err = d.configInterfaceRequestOut(prepareRequest, uint16(pages))
+	}
+	if err != nil {
+		return fmt.Errorf("error preparing image: %v", err)
 	}
-	fmt.Print("\n")
 
-	err = d.configInterfaceRequestOut(CFG_REQUEST_IMG_INSTALL, crc16)
+	err = d.writeImage(upload, func(packet int) {
+		progressMonitor(packet, packets)
+	})
 	if err != nil {
-		return fmt.Errorf("error installing image: %v", err)
+		return fmt.Errorf("error writing image, run upgrade again to resume: %v", err)
 	}
 
+	fmt.Print("\n")
+
 	return nil
 }
+
+// writeImage streams data to the upload endpoint in PAGE_SIZE packets
+func (d SoundSlideDevice) writeImage(data []byte, packetWritten func(int)) error {
+
+	stream, err := d.fwuEndpoint.NewStream(PAGE_SIZE, FWU_WRITES_IN_FLIGHT)
+	if err != nil {
+		return err
+	}
+
+	packets := (len(data) + PAGE_SIZE - 1) / PAGE_SIZE
+	for i := 0; i < packets; i++ {
+		packet := data[i*PAGE_SIZE : min((i+1)*PAGE_SIZE, len(data))]
+		written, err := stream.Write(packet)
+		if err != nil {
+			stream.Close()
+			return err
+		}
+		if written != len(packet) {
+			stream.Close()
+			return fmt.Errorf("short write")
+		}
+		packetWritten(i + 1)
+	}
+
+	// waits for the writes still in flight
+	return stream.Close()
+}
+
+// topUpImage sends the rows with pages missing on the device again, until none are missing
+func (d SoundSlideDevice) topUpImage(data []byte) error {
+
+	pages := len(data) / PAGE_SIZE
+
+	for round := 0; ; round++ {
+
+		status, err := d.GetUploadStatus()
+		if err != nil {
+			return fmt.Errorf("error getting upload status: %v", err)
+		}
+
+		runs := status.missingRuns()
+		if len(runs) == 0 {
+			return nil
+		}
+		if round == FWU_TOP_UP_ROUNDS {
+			return fmt.Errorf("pages still missing after %d top-ups", round)
+		}
+
+		for _, run := range runs {
+			fmt.Printf("resending pages %d to %d\n", run[0], run[1]-1)
+			err = d.configInterfaceRequestOut(CFG_REQUEST_IMG_SEEK, uint16(run[0]))
+			if err != nil {
+				return fmt.Errorf("error seeking image: %v", err)
+			}
+			err = d.writeImage(data[run[0]*PAGE_SIZE:min(run[1], pages)*PAGE_SIZE], func(int) {})
+			if err != nil {
+				return fmt.Errorf("error writing image, run upgrade again to resume: %v", err)
+			}
+		}
+	}
+}
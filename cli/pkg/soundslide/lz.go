@@ -0,0 +1,49 @@
+package soundslide
+
+// keep in sync with lz-decoder.cpp
+const (
+	LZ_WINDOW    = 256
+	LZ_MIN_MATCH = 3
+	LZ_MAX_MATCH = LZ_MIN_MATCH + 255
+)
+
+// lzCompress encodes data in the LZSS format decoded by the firmware:
+// groups of a flag byte and eight items, a set flag bit (lowest first) for
+// a literal byte, a clear one for a match of two bytes, distance - 1 and
+// length - LZ_MIN_MATCH, within the last LZ_WINDOW bytes.
+func lzCompress(data []byte) []byte {
+	var out []byte
+	flagsAt := 0
+	items := 8
+
+	for pos := 0; pos < len(data); {
+		if items == 8 {
+			flagsAt = len(out)
+			out = append(out, 0)
+			items = 0
+		}
+
+		bestLength, bestDistance := 0, 0
+		for distance := 1; distance <= LZ_WINDOW && distance <= pos; distance++ {
+			length := 0
+			for length < LZ_MAX_MATCH && pos+length < len(data) && data[pos+length] == data[pos+length-distance] {
+				length++
+			}
+			if length > bestLength {
+				bestLength, bestDistance = length, distance
+			}
+		}
+
+		if bestLength >= LZ_MIN_MATCH {
+			out = append(out, byte(bestDistance-1), byte(bestLength-LZ_MIN_MATCH))
+			pos += bestLength
+		} else {
+			out[flagsAt] |= 1 << items
+			out = append(out, data[pos])
+			pos++
+		}
+		items++
+	}
+
+	return out
+}
@@ -0,0 +1,145 @@
+// Decode latency of GestureDecoder (src/gesture.cpp) with and without GESTURE_EVENT_DRIVEN
+//
+// Simulates the sensor publishing frames into TouchFrameBuffer and the main
+// loop decoding them, either on the frame event or on the 20 ms timer. The
+// latency of a finger change is the time from the change to the end of the
+// decode of the first frame that shows it.
+
+// ADC scan of all channels, 16 x 14 ADC clocks per channel at 1.5 MHz with
+// TOUCH_ADC_OVERSAMPLING; `ssc clocks` reports the rate of a device
+const FRAME_US = 1200
+const DECODE_US = 150           // decode() of one frame
+const TICK_US = 10000           // genericTimer tick, clocks::TIMER_TICK_HZ
+const POLL_TICKS = 2            // start(clocks::timerTicks(20))
+const DURATION_US = 10000000
+const CHANGES = 2000
+
+// Port of TouchFrameBuffer in src/touch.cpp, keep in sync
+class TouchFrameBuffer {
+
+    constructor() {
+        this.slots = new Array(4).fill(null).map(() => ({ sequence: 0, timestamp: 0 }))
+        this.published = 0
+    }
+
+    publish(timestamp) {
+        let sequence = this.published + 1
+        let frame = this.slots[sequence % this.slots.length]
+        frame.timestamp = timestamp
+        frame.sequence = sequence
+        this.published = sequence
+    }
+
+    read(lastSequence) {
+        let sequence = this.published
+        if (sequence == lastSequence) {
+            return null
+        }
+        return Object.assign({}, this.slots[sequence % this.slots.length])
+    }
+}
+
+// returns the decodes as [end time, sequence of the frame decoded], and the frames never decoded
+function simulate(eventDriven) {
+
+    let ring = new TouchFrameBuffer()
+    let decodes = []
+    let frameSequence = 0
+    let framesMissed = 0
+
+    let busyUntil = 0                     // main loop
+    let nextFrame = FRAME_US
+    let nextTimer = TICK_US * POLL_TICKS
+    let eventAt = Infinity                // frame event scheduled, not run yet
+
+    while (nextFrame <= DURATION_US) {
+
+        let runAt = Math.max(busyUntil, eventDriven ? eventAt : nextTimer)
+
+        // the sensor interrupt preempts the main loop
+        if (runAt >= nextFrame) {
+            ring.publish(nextFrame)
+            if (eventDriven && eventAt == Infinity) {
+                eventAt = nextFrame
+            }
+            nextFrame += FRAME_US
+            continue
+        }
+
+        let frame = ring.read(frameSequence)
+        busyUntil = runAt + (frame ? DECODE_US : 0)
+        if (frame) {
+            if (frameSequence != 0) {
+                framesMissed += frame.sequence - frameSequence - 1
+            }
+            frameSequence = frame.sequence
+            decodes.push([busyUntil, frame.sequence])
+        }
+
+        if (eventDriven) {
+            eventAt = Infinity
+        }
+        else {
+            // re-armed after processing, counted from the tick it is in
+            nextTimer = (Math.floor(busyUntil / TICK_US) + POLL_TICKS) * TICK_US
+        }
+    }
+
+    return { decodes, framesMissed }
+}
+
+// deterministic finger changes over the run
+function changeTimes() {
+    let seed = 12345
+    let times = []
+    for (let i = 0; i < CHANGES; i++) {
+        seed = (seed * 1103515245 + 12345) % 2147483648
+        times.push(Math.floor(seed / 2147483648 * (DURATION_US - 4 * TICK_US * POLL_TICKS)))
+    }
+    return times.sort((a, b) => a - b)
+}
+
+function latencies(decodes, times) {
+    let out = []
+    let d = 0
+    for (let t of times) {
+        // the first frame completed at or after the change shows it
+        let sequence = Math.ceil(t / FRAME_US)
+        while (d < decodes.length && decodes[d][1] < sequence) {
+            d++
+        }
+        out.push(decodes[d][0] - t)
+    }
+    return out
+}
+
+let times = changeTimes()
+let results = {}
+
+console.log(`frame period ${FRAME_US / 1000} ms, decode ${DECODE_US / 1000} ms, ${CHANGES} finger changes\n`)
+
+for (let [name, eventDriven] of [['20 ms poll', false], ['frame event', true]]) {
+
+    let run = simulate(eventDriven)
+    let latency = latencies(run.decodes, times)
+    let mean = latency.reduce((a, b) => a + b, 0) / latency.length
+    let max = Math.max(...latency)
+    results[name] = { mean, max }
+
+    console.log(`${name}:`)
+    console.log(`  latency mean ${(mean / 1000).toFixed(2)} ms, max ${(max / 1000).toFixed(2)} ms`)
+    console.log(`  frames decoded ${run.decodes.length}, missed ${run.framesMissed}`)
+}
+
+let failures = []
+if (results['frame event'].max > FRAME_US + DECODE_US) {
+    failures.push('frame event latency exceeds one frame period and a decode')
+}
+if (results['20 ms poll'].mean < TICK_US * POLL_TICKS / 2) {
+    failures.push('20 ms poll latency below half its period, the simulation is off')
+}
+
+if (failures.length) {
+    console.log('\n' + failures.join('\n'))
+    process.exit(1)
+}
@@ -0,0 +1,267 @@
+// Interrupt transfers of HidEndpoint (src/usb-hid.cpp) for gesture traces
+//
+// Each trace is what the gesture decoder reports, one entry per 20 ms step
+// of the former slide queue, which called reportScroll() on every step.
+// The host polls the endpoint every POLL_MS. Counts the reports sent and
+// checks them against the ones the trace needs.
+
+const POLL_MS = 1
+const STEP_MS = 20
+
+const KEY_VOLUME_UP = 0
+const KEY_LOCK_WORKSTATION = 5
+
+const REPORT_CONSUMER_KEYS = 0
+const REPORT_VOLUME = 1
+const REPORT_SCROLL = 2
+const REPORT_MODIFIERS = 3
+const REPORT_KEY_CODE = 4
+const REPORT_SIZE = 5
+
+const MODIFIER_LEFT_GUI = 0x08
+const KEY_CODE_L = 0x0F
+
+class RelativeAccumulator {
+
+    constructor() {
+        this.produced = 0
+        this.consumed = 0
+    }
+
+    add(steps) {
+        let pending = this.produced != this.consumed
+        this.produced += steps
+        return pending
+    }
+
+    peek() {
+        return Math.max(-127, Math.min(127, this.produced - this.consumed))
+    }
+
+    take(steps) {
+        this.consumed += steps
+    }
+
+    clear() {
+        this.consumed = this.produced
+    }
+}
+
+// Port of HidEndpoint, keep in sync; startTx() hands the report to `usb`
+class HidEndpoint {
+
+    constructor(usb) {
+        this.usb = usb
+        this.keyQueue = new Array(8).fill(null).map(() => ({ key: 0, produced: 0, consumed: 0 }))
+        this.keyQueueHead = 0
+        this.keyQueueTail = 0
+        this.releasePending = false
+        this.scroll = new RelativeAccumulator()
+        this.volume = new RelativeAccumulator()
+        this.busy = false
+        this.lastReport = new Array(REPORT_SIZE).fill(0)
+    }
+
+    isDirty(report) {
+        return report[REPORT_VOLUME] != 0 ||
+            report[REPORT_SCROLL] != 0 ||
+            report[REPORT_CONSUMER_KEYS] != this.lastReport[REPORT_CONSUMER_KEYS] ||
+            report[REPORT_MODIFIERS] != this.lastReport[REPORT_MODIFIERS] ||
+            report[REPORT_KEY_CODE] != this.lastReport[REPORT_KEY_CODE]
+    }
+
+    startReport() {
+        if (!this.busy) {
+            this.busy = true
+            this.sendReport()
+        }
+    }
+
+    event(index) {
+        return this.keyQueue[index % this.keyQueue.length]
+    }
+
+    reset() {
+        this.keyQueueHead = this.keyQueueTail
+        this.releasePending = false
+        this.scroll.clear()
+        this.volume.clear()
+        this.lastReport = new Array(REPORT_SIZE).fill(0)
+        this.busy = false
+    }
+
+    reportKey(key, count) {
+        if (count) {
+            if (this.keyQueueTail != this.keyQueueHead) {
+                let last = this.event(this.keyQueueTail - 1)
+                if (last.key == key) {
+                    last.produced += count
+                    this.startReport()
+                    return
+                }
+            }
+            if (this.keyQueueTail - this.keyQueueHead >= this.keyQueue.length) {
+                return
+            }
+            let event = this.event(this.keyQueueTail)
+            event.key = key
+            event.consumed = 0
+            event.produced = count
+            this.keyQueueTail++
+            this.startReport()
+        }
+    }
+
+    reportScroll(steps) {
+        if (steps) {
+            this.scroll.add(steps)
+            this.startReport()
+        }
+    }
+
+    reportVolume(steps) {
+        if (steps) {
+            this.volume.add(steps)
+            this.startReport()
+        }
+    }
+
+    sendReport() {
+
+        while (
+            !this.releasePending &&
+            this.keyQueueHead + 1 != this.keyQueueTail && this.keyQueueHead != this.keyQueueTail &&
+            this.event(this.keyQueueHead).consumed == this.event(this.keyQueueHead).produced
+        ) {
+            this.keyQueueHead++
+        }
+
+        let key = -1
+        let keyDown = false
+        if (this.keyQueueHead != this.keyQueueTail) {
+            let event = this.event(this.keyQueueHead)
+            if (this.releasePending) {
+                key = event.key
+                event.consumed++
+                this.releasePending = false
+            } else if (event.consumed != event.produced) {
+                key = event.key
+                keyDown = true
+                this.releasePending = true
+            }
+        }
+
+        let scrollSteps = this.scroll.peek()
+        let volumeSteps = this.volume.peek()
+
+        let report = new Array(REPORT_SIZE).fill(0)
+        if (keyDown) {
+            if (key == KEY_LOCK_WORKSTATION) {
+                report[REPORT_MODIFIERS] = MODIFIER_LEFT_GUI
+                report[REPORT_KEY_CODE] = KEY_CODE_L
+            } else {
+                report[REPORT_CONSUMER_KEYS] = 1 << key
+            }
+        }
+        report[REPORT_VOLUME] = volumeSteps
+        report[REPORT_SCROLL] = scrollSteps
+
+        if (!this.isDirty(report)) {
+            this.busy = false
+            return
+        }
+
+        this.lastReport = report
+        this.volume.take(volumeSteps)
+        this.scroll.take(scrollSteps)
+
+        this.usb.startTx(report)
+    }
+
+    txComplete() {
+        this.sendReport()
+    }
+}
+
+// returns the reports sent for a trace of [method, ...arguments] per step, a list of them or null for none;
+// 'busReset' drops the report in flight and resets the endpoint, as SoundSlideUsbDevice does on EORST
+function run(trace) {
+
+    let inFlight = null
+    let sent = []
+    let usb = { startTx: report => { inFlight = report } }
+    let endpoint = new HidEndpoint(usb)
+
+    let steps = trace.length + 10
+    for (let ms = 0; ms < steps * STEP_MS; ms += POLL_MS) {
+        let step = ms / STEP_MS
+        if (Number.isInteger(step) && step < trace.length && trace[step]) {
+            let calls = Array.isArray(trace[step][0]) ? trace[step] : [trace[step]]
+            for (let [method, ...args] of calls) {
+                if (method == 'busReset') {
+                    inFlight = null
+                    endpoint.reset()
+                }
+                else {
+                    endpoint[method](...args)
+                }
+            }
+        }
+        // host poll: the report in the bank goes out, its completion builds the next one
+        if (inFlight) {
+            sent.push(inFlight)
+            inFlight = null
+            endpoint.txComplete()
+        }
+    }
+    return sent
+}
+
+function repeat(count, entry) {
+    return new Array(count).fill(entry)
+}
+
+let traces = [
+    // the former queue reported a zero change every step
+    { name: 'idle, scroll', trace: repeat(100, ['reportScroll', 0]), expected: 0 },
+    { name: 'idle, volume', trace: repeat(100, ['reportVolume', 0]), expected: 0 },
+    { name: 'idle, keys', trace: repeat(100, ['reportKey', KEY_VOLUME_UP, 0]), expected: 0 },
+    // a step of movement per queue step, then the finger rests
+    { name: 'slide, scroll', trace: repeat(50, ['reportScroll', 1]).concat(repeat(50, ['reportScroll', 0])), expected: 50 },
+    { name: 'slide, volume', trace: repeat(50, ['reportVolume', -2]).concat(repeat(50, ['reportVolume', 0])), expected: 50 },
+    // key down and up per press
+    { name: 'slide, keys', trace: repeat(10, ['reportKey', KEY_VOLUME_UP, 1]).concat(repeat(90, null)), expected: 20 },
+    { name: 'double tap', trace: [['reportKey', KEY_LOCK_WORKSTATION, 1]].concat(repeat(99, null)), expected: 2 },
+    // the transfer in flight is lost, the reports after the reset still go out
+    {
+        name: 'bus reset, scroll',
+        trace: repeat(10, ['reportScroll', 1]).concat([[['reportScroll', 1], ['busReset']]], repeat(10, ['reportScroll', 1]), repeat(79, null)),
+        expected: 20
+    },
+    {
+        name: 'bus reset, keys',
+        trace: [[['reportKey', KEY_VOLUME_UP, 3], ['busReset']]].concat(repeat(10, ['reportKey', KEY_VOLUME_UP, 1]), repeat(89, null)),
+        expected: 20
+    }
+]
+
+let failures = 0
+
+for (let { name, trace, expected } of traces) {
+
+    let sent = run(trace)
+    // before change-only reporting the scroll mode sent a report for a zero change too
+    let empty = trace.filter(entry => entry && entry[0] == 'reportScroll' && entry[1] == 0).length
+    let matches = sent.length == expected
+
+    console.log(`${name}: ${sent.length} reports (${expected} expected, ${sent.length + empty} before)${matches ? '' : ' MISMATCH'}`)
+
+    if (!matches) {
+        failures++
+    }
+}
+
+if (failures) {
+    console.log(`\n${failures} of ${traces.length} traces sent a different number of reports`)
+    process.exit(1)
+}
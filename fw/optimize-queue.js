@@ -1,18 +1,6 @@
 
-let tests = [
-    [-2, +2, +3, -1],
-    [-3, +1, +2, -4],
-    [+1, +2, +3, +4],
-    [0, -1, +2, 0],
-    [0, -1, -2, -2],
-    [-2, -3, 1, -1],
-    [0, 0, -2, 1]
-]
-
-for (let test of tests) {
-
-    let origStr = test.join(',')
-    let origSum = test.reduce((a, b) => a + b, 0)
+// Reference: the delay line queue optimization formerly done by GestureDecoder::optimizeQueue
+function optimizeQueue(test) {
 
     let positives = test.filter(x => x > 0).reduce((a, b) => a + b, 0)
     let negatives = test.filter(x => x < 0).reduce((a, b) => a - b, 0)
@@ -36,9 +24,141 @@ for (let test of tests) {
         test[i] += c * side
         correction -= c
     }
+}
+
+// Port of DirectionFilter in src/direction-filter.cpp, keep in sync
+class DirectionFilter {
+
+    constructor(hysteresis) {
+        this.hysteresis = hysteresis
+        this.reset()
+    }
+
+    reset() {
+        this.pending = 0
+        this.direction = 0
+    }
+
+    filter(delta) {
+
+        this.pending += delta
+
+        let out = 0
+        if (this.pending > this.hysteresis) {
+            out = this.pending - this.hysteresis
+        } else if (this.pending < -this.hysteresis) {
+            out = this.pending + this.hysteresis
+        }
+
+        if (out != 0) {
+            this.pending -= out
+            this.direction = out > 0 ? 1 : -1
+        }
+
+        return out
+    }
+
+    settle() {
+        let out = this.pending * this.direction >= 0 ? this.pending : 0
+        this.reset()
+        return out
+    }
+}
+
+const QUEUE_SIZE = 4
+const TICK_MS = 20
+// in the units of the traces below, the firmware uses a quarter channel
+const HYSTERESIS = 2
+
+// runs a trace of per-tick deltas through the old delay line, one output per tick
+function runDelayLine(trace) {
+    let queue = new Array(QUEUE_SIZE).fill(0)
+    let out = []
+    for (let t = 0; t < trace.length + QUEUE_SIZE; t++) {
+        queue[0] = t < trace.length ? trace[t] : 0
+        optimizeQueue(queue)
+        out.push(queue[QUEUE_SIZE - 1])
+        queue.unshift(0)
+        queue.pop()
+    }
+    return out
+}
+
+// the finger is lifted after the last delta of the trace
+function runDirectionFilter(trace) {
+    let filter = new DirectionFilter(HYSTERESIS)
+    let out = trace.map(delta => filter.filter(delta))
+    out.push(filter.settle())
+    return out.concat(new Array(QUEUE_SIZE - 1).fill(0))
+}
+
+// mean time at which a unit of movement is reported, in ticks
+function meanTime(out) {
+    let moved = out.reduce((a, b) => a + Math.abs(b), 0)
+    return moved ? out.reduce((a, b, t) => a + t * Math.abs(b), 0) / moved : 0
+}
 
-    console.log(`[${origStr}] ∑=${origSum} => [${test}] ∑=${test.reduce((a, b) => a + b, 0)}`)
+function reversals(out) {
+    let moves = out.filter(x => x != 0)
+    return moves.filter((x, i) => i > 0 && x * moves[i - 1] < 0).length
 }
 
+function sum(out) {
+    return out.reduce((a, b) => a + b, 0)
+}
+
+let tests = [
+    [-2, +2, +3, -1],
+    [-3, +1, +2, -4],
+    [+1, +2, +3, +4],
+    [0, -1, +2, 0],
+    [0, -1, -2, -2],
+    [-2, -3, 1, -1],
+    [0, 0, -2, 1]
+]
+
+let traces = [
+    [+1, +1, +1, +1, +1, +1],
+    [+1, +1, -1, +1, +1, +1],
+    [+2, +2, 0, 0, -2, -2, -2],
+    [+1, -1, +1, -1, +1, -1],
+    [0, 0, -2, 1, -2, -2]
+].concat(tests.map(test => test.slice()))  // the queue tests as traces, before optimizeQueue changes them
 
+console.log('Queue optimization (reference):')
 
+for (let test of tests) {
+
+    let origStr = test.join(',')
+    let origSum = sum(test)
+
+    optimizeQueue(test)
+
+    console.log(`[${origStr}] ∑=${origSum} => [${test}] ∑=${sum(test)}`)
+}
+
+console.log('\nDelay line vs. DirectionFilter:')
+
+let failures = 0
+
+for (let trace of traces) {
+
+    let reference = runDelayLine(trace)
+    let filtered = runDirectionFilter(trace)
+    let saved = (meanTime(reference) - meanTime(filtered)) * TICK_MS
+    let matches = sum(filtered) == sum(reference) && reversals(filtered) == reversals(reference)
+
+    console.log(`[${trace}]${matches ? '' : ' MISMATCH'}`)
+    console.log(`  delay line: [${reference}] ∑=${sum(reference)} reversals=${reversals(reference)}`)
+    console.log(`  filter:     [${filtered}] ∑=${sum(filtered)} reversals=${reversals(filtered)}`)
+    console.log(`  latency saved: ${saved.toFixed(1)} ms`)
+
+    if (!matches) {
+        failures++
+    }
+}
+
+if (failures) {
+    console.log(`\n${failures} of ${traces.length} traces differ from the delay line in net travel or reversals`)
+    process.exit(1)
+}
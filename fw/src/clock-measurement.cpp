@@ -0,0 +1,151 @@
+/*
+ * ClockMeasurement - checks the clock plan (clocks.cpp) once after boot
+ *
+ * The host sends USB start of frames at exactly 1 kHz, counted by FNUM.
+ * The window is sampled in slices, one per timer tick, so the main loop
+ * keeps running: a slice waits for the next frame and counts the CPU
+ * cycles (SysTick) of the frame after it, one to two ms of busy waiting.
+ * SysTick wraps every timer tick, a single frame is well within that.
+ * Timebase ticks and touch frames published are counted from the start of
+ * the first slice to the end of the last one, over the USB frames between
+ * them. This gives the achieved CPU clock, timebase frequency and touch
+ * frame rate. Until the host sends frames, it keeps waiting; if they stop
+ * during the window, it starts over.
+ *
+ * It runs once, so plain divisions are fine here.
+ */
+class ClockMeasurement : public genericTimer::Timer {
+
+    static const int INTERVAL = clocks::timerTicks(100); // between checks for frames
+    static const int SLICE_INTERVAL = 1;    // timer ticks between slices
+    static const int WINDOW_SLICES = 100;   // about a second of USB frames with SLICE_INTERVAL
+    static const int FNUM_MODULO = 2048;
+    // without a frame for this long the host has stopped sending them (suspend)
+    static const unsigned int FRAME_TIMEOUT_CYCLES = 10 * (clocks::CPU_HZ / clocks::USB_SOF_HZ);
+
+    TouchSensor* touchSensor;
+
+    int lastFnum = -1;
+
+    // the window so far
+    int slices = 0;
+    unsigned int sliceCycles = 0;   // CPU cycles of the frames counted by the slices
+    int sliceFrames = 0;            // those frames
+    int windowFnum;                 // at the end of the last slice
+    int windowFrames;               // from the start of the first slice
+    unsigned int startTicks;
+    unsigned int startTouchFrames;
+
+    bool measured = false;
+    int cpuHz = 0;
+    int timebaseHz = 0;
+    int touchFrameMilliHz = 0;
+
+    unsigned int touchFrames() {
+        TouchFrame frame;
+        return touchSensor->readFrame(&frame, 0) ? frame.sequence : 0;
+    }
+
+    // waits for the next frame, counting the cycles meanwhile; false on timeout
+    bool waitFrame(int* fnum, unsigned int* count, unsigned int* cycles) {
+        unsigned int waited = 0;
+        while (target::USB.DEVICE.FNUM.getFNUM() == *fnum) {
+            unsigned int now = clocks::cycleCount();
+            unsigned int elapsed = clocks::cyclesBetween(*count, now);
+            *count = now;
+            *cycles += elapsed;
+            waited += elapsed;
+            if (waited > FRAME_TIMEOUT_CYCLES) {
+                return false;
+            }
+        }
+        *fnum = target::USB.DEVICE.FNUM.getFNUM();
+        return true;
+    }
+
+    // counts the CPU cycles of one frame, from frame start to frame start; false on timeout
+    bool slice() {
+        int fnum = target::USB.DEVICE.FNUM.getFNUM();
+        unsigned int count = clocks::cycleCount();
+        unsigned int cycles = 0;
+
+        if (!waitFrame(&fnum, &count, &cycles)) {
+            return false;
+        }
+        if (slices == 0) {
+            windowFnum = fnum;
+            windowFrames = 0;
+            startTicks = timebase::now();
+            startTouchFrames = touchFrames();
+        }
+
+        cycles = 0;
+        int first = fnum;
+        if (!waitFrame(&fnum, &count, &cycles)) {
+            return false;
+        }
+
+        // more than one frame if interrupts held the wait past one
+        sliceFrames += (fnum - first + FNUM_MODULO) % FNUM_MODULO;
+        sliceCycles += cycles;
+        windowFrames += (fnum - windowFnum + FNUM_MODULO) % FNUM_MODULO;
+        windowFnum = fnum;
+        slices++;
+        return true;
+    }
+
+    void finish() {
+        unsigned int ticks = timebase::now() - startTicks;
+        unsigned int touched = touchFrames() - startTouchFrames;
+
+        cpuHz = (unsigned long long)sliceCycles * clocks::USB_SOF_HZ / sliceFrames;
+        timebaseHz = (unsigned long long)ticks * clocks::USB_SOF_HZ / windowFrames;
+        touchFrameMilliHz = (unsigned long long)touched * 1000 * clocks::USB_SOF_HZ / windowFrames;
+        measured = true;
+    }
+
+    void onTimer() {
+        int fnum = target::USB.DEVICE.FNUM.getFNUM();
+        if (lastFnum >= 0 && fnum != lastFnum) {
+            if (!slice()) {
+                // the host stopped sending frames, start over once it's back
+                slices = 0;
+                sliceCycles = 0;
+                sliceFrames = 0;
+            }
+            else if (slices == WINDOW_SLICES) {
+                finish();
+            }
+            fnum = target::USB.DEVICE.FNUM.getFNUM();
+        }
+        lastFnum = fnum;
+
+        if (!measured) {
+            start(slices > 0 ? SLICE_INTERVAL : INTERVAL);
+        }
+    }
+
+public:
+
+    void init(TouchSensor* touchSensor) {
+        this->touchSensor = touchSensor;
+        start(INTERVAL);
+    }
+
+    bool isMeasured() {
+        return measured;
+    }
+
+    int getCpuHz() {
+        return cpuHz;
+    }
+
+    int getTimebaseHz() {
+        return timebaseHz;
+    }
+
+    int getTouchFrameMilliHz() {
+        return touchFrameMilliHz;
+    }
+
+};
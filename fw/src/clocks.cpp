@@ -0,0 +1,163 @@
+/*
+ * clocks - the clock plan, every clock source and generator is set up here
+ *
+ *   DFLL48M, closed loop in USB clock recovery mode (locks to the 1 kHz start
+ *   of frame of the host, runs open loop from the factory calibration until
+ *   the first one)
+ *     -> GCLK0  48 MHz     CPU, AHB/APB buses, SysTick (genericTimer), USB
+ *     -> GCLK3   6 MHz     ADC, divided further by ADC.CTRLB.PRESCALER
+ *   OSCULP32K
+ *     -> GCLK4  32.768 kHz TC1/TC2, timebase
+ *
+ * Consumers take their frequency from the constants here rather than
+ * assuming one. NVM wait states are set for CPU_HZ before GCLK0 switches
+ * to the DFLL.
+ */
+namespace clocks {
+
+    const int CPU_HZ = 48000000;
+    const int ADC_HZ = 6000000;
+    const int TIMEBASE_HZ = 32768;
+
+    // genericTimer tick, the library (si-systick-timer) sets SysTick up for it
+    const int TIMER_TICK_HZ = 100;
+
+    const int USB_SOF_HZ = 1000;
+    const int DFLL_MULTIPLIER = CPU_HZ / USB_SOF_HZ;
+
+    const int ADC_GENERATOR = 3;
+    const int TIMEBASE_GENERATOR = 4;
+
+    // up to 24 MHz without wait states, one more up to 48 MHz (VDD 2.7 V and above)
+    const int NVM_ZERO_WAIT_STATE_HZ = 24000000;
+
+    // genericTimer::Timer::start() ticks for a delay
+    constexpr int timerTicks(int milliseconds) {
+        return milliseconds * TIMER_TICK_HZ / 1000;
+    }
+
+    // ADC.CTRLB.PRESCALER DIV512
+    const int ADC_PRESCALER_MAX = 7;
+
+    // ADC.CTRLB.PRESCALER for an ADC clock, DIV4 (0) to DIV512 (7), above ADC_PRESCALER_MAX if too low
+    constexpr int adcPrescaler(int adcClockHz, int divider = 4, int prescaler = 0) {
+        return ADC_HZ / divider <= adcClockHz || prescaler > ADC_PRESCALER_MAX ? prescaler : adcPrescaler(adcClockHz, divider * 2, prescaler + 1);
+    }
+
+    void waitGclkSync() {
+        while (target::GCLK.STATUS.getSYNCBUSY());
+    }
+
+    void initGenerator(int id, target::gclk::GENCTRL::SRC source, int divider) {
+        target::GCLK.GENDIV = target::GCLK.GENDIV.bare()
+            .setID(id)
+            .setDIV(divider);
+        waitGclkSync();
+
+        target::GCLK.GENCTRL = target::GCLK.GENCTRL.bare()
+            .setID(id)
+            .setSRC(source)
+            .setIDC(true)
+            .setGENEN(true);
+        waitGclkSync();
+    }
+
+    void routeClock(target::gclk::CLKCTRL::ID peripheral, target::gclk::CLKCTRL::GEN generator) {
+        target::GCLK.CLKCTRL = target::GCLK.CLKCTRL.bare()
+            .setID(peripheral)
+            .setGEN(generator)
+            .setCLKEN(true);
+    }
+
+    // every DFLL register write has to synchronize before the next one
+    void waitDfllSync() {
+        while (!target::SYSCTRL.PCLKSR.getDFLLRDY());
+    }
+
+    void initDfll() {
+        // DFLLCTRL must be written with ONDEMAND clear before any other DFLL register (errata)
+        target::SYSCTRL.DFLLCTRL = target::SYSCTRL.DFLLCTRL.bare().setENABLE(true);
+        waitDfllSync();
+
+        // open loop start from the factory calibration, fine step in the middle
+        target::SYSCTRL.DFLLVAL = target::SYSCTRL.DFLLVAL.bare()
+            .setCOARSE(target::NVMCALIB.SOFT1.getDFLL48M_COARSE_CAL())
+            .setFINE(512);
+        waitDfllSync();
+
+        // small steps, the reference is exact
+        target::SYSCTRL.DFLLMUL = target::SYSCTRL.DFLLMUL.bare()
+            .setCSTEP(1)
+            .setFSTEP(1)
+            .setMUL(DFLL_MULTIPLIER);
+        waitDfllSync();
+
+        target::SYSCTRL.DFLLCTRL = target::SYSCTRL.DFLLCTRL.bare()
+            .setENABLE(true)
+            .setMODE(true)
+            .setUSBCRM(true)
+            .setCCDIS(true);
+        waitDfllSync();
+    }
+
+    void init() {
+
+        target::NVMCTRL.CTRLB.setRWS(CPU_HZ > NVM_ZERO_WAIT_STATE_HZ ? target::nvmctrl::CTRLB::RWS::HALF : target::nvmctrl::CTRLB::RWS::SINGLE);
+
+        initDfll();
+
+        // DFLL48M -> GCLK0 -> CPU, USB
+
+        initGenerator(0, target::gclk::GENCTRL::SRC::DFLL48M, 1);
+        routeClock(target::gclk::CLKCTRL::ID::USB, target::gclk::CLKCTRL::GEN::GCLK0);
+
+        // DFLL48M -> GCLK3 -> ADC
+
+        initGenerator(ADC_GENERATOR, target::gclk::GENCTRL::SRC::DFLL48M, CPU_HZ / ADC_HZ);
+        routeClock(target::gclk::CLKCTRL::ID::ADC, target::gclk::CLKCTRL::GEN::GCLK3);
+
+        // OSCULP32K -> GCLK4 -> TC1/TC2
+
+        initGenerator(TIMEBASE_GENERATOR, target::gclk::GENCTRL::SRC::OSCULP32K, 1);
+        routeClock(target::gclk::CLKCTRL::ID::TC1_TC2, target::gclk::CLKCTRL::GEN::GCLK4);
+    }
+
+    // true once the DFLL has locked to the USB start of frames
+    bool isLocked() {
+        return target::SYSCTRL.PCLKSR.getDFLLLCKF();
+    }
+
+    // SysTick counts CPU cycles down from its reload value, which genericTimer owns
+    unsigned int cycleCount() {
+        return target::SYSTICK.VAL.getCURRENT();
+    }
+
+    // CPU cycles between two cycleCount() values, for spans shorter than a SysTick period
+    unsigned int cyclesBetween(unsigned int start, unsigned int end) {
+        return start >= end ? start - end : start + target::SYSTICK.LOAD.getRELOAD() + 1 - end;
+    }
+
+    // shortest and longest run of a piece of code in CPU cycles, interrupts taken meanwhile included
+    class CycleMeter {
+        unsigned int startCount;
+
+    public:
+        volatile unsigned int min = 0xFFFFFFFF; // above max until the first run
+        volatile unsigned int max = 0;
+
+        void start() {
+            startCount = cycleCount();
+        }
+
+        void stop() {
+            unsigned int cycles = cyclesBetween(startCount, cycleCount());
+            if (cycles < min) {
+                min = cycles;
+            }
+            if (cycles > max) {
+                max = cycles;
+            }
+        }
+    };
+
+}
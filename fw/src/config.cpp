@@ -1,20 +1,328 @@
 const int CONFIG_BASE_ADDRESS = 0x4000 - flash::PAGES_PER_ROW * flash::PAGE_SIZE; // last row in flash memory
+const int CONFIG_RECORD_SLOTS = flash::PAGES_PER_ROW; // a record per page
+const int CONFIG_PROFILES = 4;
+const int CONFIG_PROFILE_PARAMETERS = 5;
+const int CONFIG_PROFILE_NAME_SIZE = 7; // zero padded, not terminated when full
+const int CONFIG_DATA_SIZE = CONFIG_PROFILES * (CONFIG_PROFILE_PARAMETERS + CONFIG_PROFILE_NAME_SIZE) + 1;
+// first byte of the configuration block (getBlock), changes when a field changes meaning;
+// new fields are appended without a change, a block may be shorter or longer than ours
+const int CONFIG_BLOCK_VERSION = 1;
+const int CONFIG_BLOCK_SIZE = 1 + CONFIG_DATA_SIZE;
+const int CONFIG_LEGACY_SIZE = 4; // parameters saved by firmware before 1.1
+const int CONFIG_SAVE_DELAY = clocks::timerTicks(1000); // timer ticks without another change before a change is saved
+const unsigned short CRC16_CCITT_POLYNOMIAL = 0x1021;
 
 const int DEVICE_FUNCTION_VOLUME = 0x00; // Volume control function
 const int DEVICE_FUNCTION_SCROLL = 0x01; // Scroll function
 const int DEVICE_FUNCTION_BRIGHTNESS = 0x02; // Brightness control function
 
-class DeviceConfiguration : public applicationEvents::EventHandler {
+const int DEVICE_VOLUME_KEYS = 0x00; // Volume Up/Down key press and release per step
+const int DEVICE_VOLUME_LINEAR = 0x01; // Consumer Volume linear control, whole slide delta in one report
+
+const int SLIDE_ACTION_NONE = 0;
+const int SLIDE_ACTION_KEYS = 1;
+const int SLIDE_ACTION_SCROLL = 2;
+const int SLIDE_ACTION_VOLUME = 3;
+
+// what a slide does, indexed by DEVICE_FUNCTION_*
+struct SlideAction {
+    int action;       // SLIDE_ACTION_*
+    int keyIncrease;  // key for positive steps if action is SLIDE_ACTION_KEYS
+    int keyDecrease;  // key for negative steps
+};
+
+static const SlideAction SLIDE_ACTIONS[] = {
+    { SLIDE_ACTION_KEYS, KEY_VOLUME_UP, KEY_VOLUME_DOWN },
+    { SLIDE_ACTION_SCROLL, 0, 0 },
+    { SLIDE_ACTION_KEYS, KEY_BRIGHTNESS_UP, KEY_BRIGHTNESS_DOWN }
+};
+
+// sensitivity 0..100 to touch threshold in 8-bit sample steps
+struct ThresholdTable {
+    unsigned char values[101];
+
+    constexpr ThresholdTable() : values() {
+        for (int sensitivity = 0; sensitivity <= 100; sensitivity++) {
+            values[sensitivity] = ((100 - sensitivity) * 7 / 100) + 2;
+        }
+    }
+};
+
+static constexpr ThresholdTable SENSITIVITY_THRESHOLDS;
+
+// above any sample, sensitivity 0 turns the sensor off
+const int THRESHOLD_SENSOR_OFF = 0x10000;
+
+// parameters of one profile, indexed by the keys of DeviceConfiguration::setParameter()
+union ProfileParameters {
+    unsigned char raw[CONFIG_PROFILE_PARAMETERS];
+    struct {
+        unsigned char flip; // 0 - normal, 1 - flip, default: 0
+        unsigned char scale; // sensor step multiplier 1..4, default: 2
+        unsigned char sensitivity; // sensor sensitivity 0..100, default: 20
+        unsigned char function; // see DEVICE_FUNCTION_* constants
+        unsigned char volume; // volume report mode, see DEVICE_VOLUME_* constants, default: keys
+    } fields;
+};
+
+// start of a saved configuration, each in its own page of the config row
+struct ConfigRecordHeader {
+    unsigned short sequence; // of the save, wraps, newer than the others in the row by serial number arithmetic
+    unsigned short crc;      // CRC16 CCITT of the rest of the header and the data
+    unsigned int erases;     // of the config row since the first save, the wear counter
+    unsigned short length;   // of the data following the header, may differ between firmware versions
+    unsigned short reserved; // 0xFFFF
+};
+
+static_assert(sizeof(ConfigRecordHeader) + CONFIG_DATA_SIZE <= flash::PAGE_SIZE, "config record must fit a page");
+
+// CRC16 CCITT, seed 0xFFFF
+unsigned short crc16Ccitt(const unsigned char* data, int length, unsigned short crc = 0xFFFF) {
+    for (int i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ CRC16_CCITT_POLYNOMIAL : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// values derived from the configuration, so the hot paths don't evaluate the raw fields
+struct ConfigSnapshot {
+    int threshold;      // touch threshold in 8-bit sample steps
+    int scale;          // slide step multiplier, negative if flipped
+    SlideAction slide;
+};
+
+/*
+ * DeviceConfiguration - persistent device parameters
+ *
+ * Every change of data rebuilds a ConfigSnapshot and publishes it by swapping
+ * a pointer between two buffers. The new snapshot is always built in the
+ * buffer not published, so readers (ADC ISR, gesture decoder) see either the
+ * old or the new one complete. A reader that copies its snapshot is done long
+ * before a second control transfer could change the configuration again.
+ *
+ * The config row is a log of records (ConfigRecordHeader and data), one
+ * per page, appended by each save. init() takes the valid record with the
+ * highest sequence number; torn or corrupted ones fail their CRC and the
+ * previous one wins. A save goes to the next erased page, without an erase;
+ * only when all CONFIG_RECORD_SLOTS pages are used does it go to the first
+ * page again, which erases the row (flash::engine erases a row for its
+ * first page). That is one erase per CONFIG_RECORD_SLOTS saves, counted in
+ * the records as the wear counter.
+ *
+ * The erase takes every record with it, and there is no other row to keep
+ * one in (the rest of the upper flash half is the upload area). A power
+ * loss between the erase and the write of the new record therefore loses
+ * the whole configuration, and the next power up starts from defaults with
+ * the wear counter reset (a torn first page is not mistaken for the layout
+ * of firmware before 1.1). The window is one page write, a few ms once per
+ * CONFIG_RECORD_SLOTS saves; outside of it a torn save falls back to the
+ * previous record.
+ *
+ * The parameters come in CONFIG_PROFILES named profiles, all kept in RAM
+ * and saved together. The snapshot is built from the selected one, so
+ * selectProfile() takes effect at the next decoded frame and touches no
+ * flash; the selection is saved with the next change, for the next power
+ * up. Parameter keys address the selected profile, or one given in their
+ * high nibble.
+ *
+ * Changes apply at once and are saved CONFIG_SAVE_DELAY after the last one,
+ * so a burst of changes costs a single record. Changes made without persist
+ * (trying values out) are not saved on their own: commit() saves
+ * them, and so does the next save of any other change, as a record always
+ * holds the whole configuration.
+ *
+ * A save is a record queued to flash::engine, which loads it into the NVM
+ * page buffer when it gets to it. Changes made while a save is in flight
+ * are saved by the next one, when it completes.
+ */
+class DeviceConfiguration : public genericTimer::Timer, public applicationEvents::EventHandler {
     int saveConfigEventId;
 
+    volatile unsigned int savesCompleted = 0;     // counted by flash::engine
+    unsigned int savesSubmitted = 0;
+    volatile bool changed = false;    // data differs from the last record saved
+    volatile bool delaySave = false;  // a change to save, (re)start the delay in onEvent()
+    volatile bool saveRequested = false; // save once flash::engine takes it, set from CFG requests
+
+    int nextSlot = 0;           // page the next save goes to, CONFIG_RECORD_SLOTS if the row is full
+    unsigned short sequence = 0; // of the last record
+    unsigned int erases = 0;
+
+    // the save in flight, built when it's queued so later changes can't tear it
+    struct {
+        ConfigRecordHeader header;
+        unsigned char data[CONFIG_DATA_SIZE];
+    } record;
+
+    const ConfigRecordHeader* slotAddress(int slot) {
+        return (const ConfigRecordHeader*)(CONFIG_BASE_ADDRESS + slot * flash::PAGE_SIZE);
+    }
+
+    bool isErased(int slot) {
+        const unsigned int* words = (const unsigned int*)slotAddress(slot);
+        for (int i = 0; i < flash::PAGE_SIZE / 4; i++) {
+            if (words[i] != 0xFFFFFFFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // CRC over everything after the crc field
+    unsigned short recordCrc(const ConfigRecordHeader* header) {
+        const unsigned char* start = (const unsigned char*)&header->erases;
+        int length = sizeof(ConfigRecordHeader) - (start - (const unsigned char*)header) + header->length;
+        return crc16Ccitt(start, length);
+    }
+
+    bool isValid(const ConfigRecordHeader* header) {
+        return header->length <= flash::PAGE_SIZE - sizeof(ConfigRecordHeader) && header->crc == recordCrc(header);
+    }
+
+    // finds the latest record and the next free page, false if there is no record
+    bool loadRecord() {
+        const ConfigRecordHeader* latest = NULL;
+        nextSlot = CONFIG_RECORD_SLOTS;
+
+        for (int slot = 0; slot < CONFIG_RECORD_SLOTS; slot++) {
+            const ConfigRecordHeader* header = slotAddress(slot);
+            if (isErased(slot)) {
+                if (nextSlot == CONFIG_RECORD_SLOTS) {
+                    nextSlot = slot;
+                }
+            }
+            else if (isValid(header) && (!latest || (short)(header->sequence - latest->sequence) > 0)) {
+                latest = header;
+            }
+        }
+
+        if (!latest) {
+            return false;
+        }
+
+        // fields missing in records of older firmware keep their defaults
+        const unsigned char* recordData = (const unsigned char*)(latest + 1);
+        for (int i = 0; i < latest->length && i < sizeof(data.raw); i++) {
+            data.raw[i] = recordData[i];
+        }
+        sequence = latest->sequence;
+        erases = latest->erases;
+        return true;
+    }
+
+    // firmware before 1.1 saved its parameters zero padded to the first page, a record torn
+    // by a power loss after the row erase is padded with 0xFF instead
+    bool isLegacy() {
+        const unsigned char* page = (const unsigned char*)CONFIG_BASE_ADDRESS;
+        if (page[0] == 0xFF) {
+            return false;
+        }
+        for (int i = CONFIG_LEGACY_SIZE; i < flash::PAGE_SIZE; i++) {
+            if (page[i] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void requestSave() {
+        delaySave = true;
+        applicationEvents::schedule(saveConfigEventId);
+    }
+
+    void save() {
+        if (savesSubmitted != savesCompleted || !saveRequested) {
+            return;
+        }
+        if (!changed) {
+            // saved by an earlier commit
+            saveRequested = false;
+            return;
+        }
+
+        int slot = nextSlot < CONFIG_RECORD_SLOTS ? nextSlot : 0;
+        // the first page of the row is written after an erase
+        unsigned int recordErases = slot == 0 ? erases + 1 : erases;
+
+        // before the copy, a change made during it gets saved again
+        changed = false;
+
+        record.header.sequence = sequence + 1;
+        record.header.erases = recordErases;
+        record.header.length = sizeof(record.data);
+        record.header.reserved = 0xFFFF;
+        for (int i = 0; i < sizeof(record.data); i++) {
+            record.data[i] = data.raw[i];
+        }
+        record.header.crc = recordCrc(&record.header);
+
+        if (flash::engine.writePage((void*)slotAddress(slot), &record, sizeof(record.header) + sizeof(record.data), &savesCompleted, saveConfigEventId)) {
+            saveRequested = false;
+            savesSubmitted++;
+            sequence++;
+            erases = recordErases;
+            nextSlot = slot + 1;
+        }
+        else {
+            // queue full of firmware pages, try again later
+            changed = true;
+            applicationEvents::schedule(saveConfigEventId);
+        }
+    }
+
+    ConfigSnapshot snapshots[2];
+    const ConfigSnapshot* volatile snapshot = &snapshots[0];
+
+    void publishSnapshot() {
+        ConfigSnapshot* next = snapshot == &snapshots[0] ? &snapshots[1] : &snapshots[0];
+        const ProfileParameters* profile = &data.fields.profiles[getProfile()];
+
+        int sensitivity = profile->fields.sensitivity;
+        if (sensitivity == 0) {
+            next->threshold = THRESHOLD_SENSOR_OFF;
+        }
+        else {
+            next->threshold = SENSITIVITY_THRESHOLDS.values[sensitivity > 100 ? 100 : sensitivity];
+        }
+
+        next->scale = profile->fields.flip ? -profile->fields.scale : profile->fields.scale;
+
+        if (profile->fields.function < sizeof(SLIDE_ACTIONS) / sizeof(SLIDE_ACTIONS[0])) {
+            next->slide = SLIDE_ACTIONS[profile->fields.function];
+        }
+        else {
+            next->slide.action = SLIDE_ACTION_NONE;
+        }
+
+        if (profile->fields.function == DEVICE_FUNCTION_VOLUME && profile->fields.volume == DEVICE_VOLUME_LINEAR) {
+            next->slide.action = SLIDE_ACTION_VOLUME;
+        }
+
+        asm volatile("" ::: "memory");
+        snapshot = next;
+    }
+
+    // key: parameter in the low nibble, profile + 1 in the high nibble or 0 for the selected one
+    unsigned char* parameterAddress(unsigned char key) {
+        int index = key & 0x0f;
+        int profile = key >> 4 ? (key >> 4) - 1 : getProfile();
+        if (index >= CONFIG_PROFILE_PARAMETERS || profile >= CONFIG_PROFILES) {
+            return NULL;
+        }
+        return &data.fields.profiles[profile].raw[index];
+    }
+
 public:
     union {
-        unsigned char raw[4];
+        unsigned char raw[CONFIG_DATA_SIZE];
         struct {
-            unsigned char flip; // 0 - normal, 1 - flip, default: 0
-            unsigned char scale; // sensor step multiplier 1..4, default: 2
-            unsigned char sensitivity; // sensor sensitivity 0..100, default: 20
-            unsigned char function; // see DEVICE_FUNCTION_* constants
+            // the first one where firmware before profiles kept its parameters
+            ProfileParameters profiles[CONFIG_PROFILES];
+            char names[CONFIG_PROFILES][CONFIG_PROFILE_NAME_SIZE];
+            unsigned char profile; // selected
         } fields;
     } data;
 
@@ -22,45 +330,150 @@ public:
         saveConfigEventId = applicationEvents::createEventId();
         handle(saveConfigEventId);
 
-        for (int i = 0; i < sizeof(data.raw); i++) {
-            unsigned char* ptr = (unsigned char*)(CONFIG_BASE_ADDRESS + i);
-            data.raw[i] = *ptr;
-        }
+        setDefaults(false);
 
-        // check for uninitialized flash (new device)
-        if (data.fields.flip == 0xff) {
-            setDefaults();
+        if (!loadRecord() && isLegacy()) {
+            // plain data in the first page, saved by firmware before 1.1
+            const unsigned char* legacy = (const unsigned char*)CONFIG_BASE_ADDRESS;
+            for (int i = 0; i < CONFIG_LEGACY_SIZE; i++) {
+                data.raw[i] = legacy[i];
+            }
+            erases = 1;
         }
+
+        publishSnapshot();
     }
 
-    void setParameter(unsigned char key, unsigned char value) {
-        if (key < sizeof(data.raw)) {
-            data.raw[key] = value;
-            applicationEvents::schedule(saveConfigEventId);
+    // current derived values, safe to read from interrupts
+    const ConfigSnapshot* getSnapshot() {
+        return snapshot;
+    }
+
+    // applies at once, saved later or, without persist, not until commit()
+    void setParameter(unsigned char key, unsigned char value, bool persist = true) {
+        unsigned char* parameter = parameterAddress(key);
+        if (parameter) {
+            *parameter = value;
+            publishSnapshot();
+            changed = true;
+            if (persist) {
+                requestSave();
+            }
         }
     }
 
     unsigned char getParameter(unsigned char key) {
-        if (key < sizeof(data.raw)) {
-            return data.raw[key];
+        unsigned char* parameter = parameterAddress(key);
+        if (parameter) {
+            return *parameter;
         }
         return 0;
     }
 
-    void setDefaults() {
-        data.fields.flip = 0;
-        data.fields.scale = 2;
-        data.fields.sensitivity = 30;
-        data.fields.function = DEVICE_FUNCTION_VOLUME;
+    int getProfile() {
+        return data.fields.profile < CONFIG_PROFILES ? data.fields.profile : 0;
+    }
+
+    // switches profiles without saving, false if there's no such profile
+    bool selectProfile(int profile) {
+        if (profile >= CONFIG_PROFILES) {
+            return false;
+        }
+        data.fields.profile = profile;
+        publishSnapshot();
+        return true;
+    }
+
+    const char* getProfileName(int profile) {
+        return data.fields.names[profile];
+    }
+
+    // name of up to CONFIG_PROFILE_NAME_SIZE bytes, saved as a parameter
+    bool setProfileName(int profile, const unsigned char* name, int length) {
+        if (profile >= CONFIG_PROFILES || length > CONFIG_PROFILE_NAME_SIZE) {
+            return false;
+        }
+        for (int i = 0; i < CONFIG_PROFILE_NAME_SIZE; i++) {
+            data.fields.names[profile][i] = i < length ? name[i] : 0;
+        }
+        changed = true;
+        requestSave();
+        return true;
+    }
+
+    // all profiles, names cleared, the first one selected
+    void setDefaults(bool persist = true) {
+        for (int i = 0; i < CONFIG_PROFILES; i++) {
+            ProfileParameters* profile = &data.fields.profiles[i];
+            profile->fields.flip = 0;
+            profile->fields.scale = 2;
+            profile->fields.sensitivity = 30;
+            profile->fields.function = DEVICE_FUNCTION_VOLUME;
+            profile->fields.volume = DEVICE_VOLUME_KEYS;
+            for (int c = 0; c < CONFIG_PROFILE_NAME_SIZE; c++) {
+                data.fields.names[i][c] = 0;
+            }
+        }
+        data.fields.profile = 0;
+        if (persist) {
+            publishSnapshot();
+            changed = true;
+            requestSave();
+        }
+    }
+
+    // the whole configuration: CONFIG_BLOCK_VERSION and data, returns the length
+    int getBlock(unsigned char* block) {
+        block[0] = CONFIG_BLOCK_VERSION;
+        for (int i = 0; i < sizeof(data.raw); i++) {
+            block[1 + i] = data.raw[i];
+        }
+        return CONFIG_BLOCK_SIZE;
+    }
+
+    // applies a block from getBlock() and saves it at once, false if its version differs;
+    // fields missing in a shorter block keep their values, extra ones are ignored
+    bool setBlock(const unsigned char* block, int length) {
+        if (length < 1 || block[0] != CONFIG_BLOCK_VERSION) {
+            return false;
+        }
+        for (int i = 0; i < length - 1 && i < sizeof(data.raw); i++) {
+            data.raw[i] = block[1 + i];
+        }
+        publishSnapshot();
+        changed = true;
+        commit();
+        return true;
+    }
+
+    // saves changes not saved yet, without waiting for CONFIG_SAVE_DELAY
+    void commit() {
+        saveRequested = true;
         applicationEvents::schedule(saveConfigEventId);
     }
 
+    // times the config row has been erased
+    unsigned int getErases() {
+        return erases;
+    }
+
+    // records in the config row, a save when full erases it
+    int getRecords() {
+        return nextSlot;
+    }
+
+    // changes, and flash::engine when a save completes
     void onEvent() {
-        unsigned char buffer[flash::PAGE_SIZE];
-        zeromem(buffer, sizeof(buffer));
-        for (int i = 0; i < sizeof(data.raw); i++) {
-            buffer[i] = data.raw[i];
+        if (delaySave) {
+            delaySave = false;
+            start(CONFIG_SAVE_DELAY);
         }
-        flash::writePage((void*)CONFIG_BASE_ADDRESS, buffer);
+        save();
+    }
+
+    // no change for CONFIG_SAVE_DELAY
+    void onTimer() {
+        saveRequested = true;
+        save();
     }
-};
\ No newline at end of file
+};
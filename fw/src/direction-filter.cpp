@@ -0,0 +1,56 @@
+/*
+ * DirectionFilter - keeps a slide moving in one direction without delaying it
+ *
+ * Replaces the delay line of optimize-queue.js, which held every step back
+ * until it could see the following ones. This is a backlash (deadband) on
+ * the travel: the output follows the input, trailing it by up to
+ * HYSTERESIS. Movement in the current direction is passed on as soon as it
+ * leaves the band; movement back has to cross the whole band (2 *
+ * HYSTERESIS from the turning point) before the direction flips, so jitter
+ * smaller than that never shows as a reversal.
+ *
+ * The travel still held in the band is settled when the finger is lifted:
+ * reported if it continues the current direction, which keeps the net
+ * travel equal to the input's, or dropped as jitter if it points back.
+ * optimize-queue.js checks net travel and reversals against the delay line.
+ */
+template <int HYSTERESIS> class DirectionFilter {
+
+    int pending;    // input travel not reported yet, within +-HYSTERESIS
+    int direction;  // of the last reported movement, 0 before the first
+
+public:
+
+    void reset() {
+        pending = 0;
+        direction = 0;
+    }
+
+    // takes a position delta, returns the delta to report
+    int filter(int delta) {
+
+        pending += delta;
+
+        int out = 0;
+        if (pending > HYSTERESIS) {
+            out = pending - HYSTERESIS;
+        }
+        else if (pending < -HYSTERESIS) {
+            out = pending + HYSTERESIS;
+        }
+
+        if (out != 0) {
+            pending -= out;
+            direction = out > 0 ? 1 : -1;
+        }
+
+        return out;
+    }
+
+    // end of the slide, returns the held back travel to report and resets the filter
+    int settle() {
+        int out = pending * direction >= 0 ? pending : 0;
+        reset();
+        return out;
+    }
+};
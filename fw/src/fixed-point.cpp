@@ -0,0 +1,54 @@
+// Arithmetic of the touch and decode paths, selected at build time:
+//   0 - divisions by variables, as before fixedPoint; kept to compare both with `ssc cycles`
+//   1 - shifts, multiplications and fixedPoint::divide
+#ifndef DIVISION_FREE
+#define DIVISION_FREE 1
+#endif
+
+/*
+ * fixedPoint - integer arithmetic for hot paths
+ *
+ * Cortex-M0 has no divide instruction, each / or % by a variable is a call
+ * to a libgcc routine looping over the bits. Divisions by compile time
+ * constants are left to the compiler; the rest goes through tables
+ * generated at compile time.
+ */
+namespace fixedPoint {
+
+    const int RECIPROCAL_BITS = 16;
+    const int RECIPROCAL_MIN = 128;
+
+    // 2^16 / d for denominators normalised to 128..255
+    struct ReciprocalTable {
+        unsigned short values[RECIPROCAL_MIN];
+
+        constexpr ReciprocalTable() : values() {
+            for (int i = 0; i < RECIPROCAL_MIN; i++) {
+                values[i] = (1 << RECIPROCAL_BITS) / (RECIPROCAL_MIN + i);
+            }
+        }
+    };
+
+    constexpr ReciprocalTable RECIPROCALS;
+
+    // numerator / denominator for denominator > 0 and a quotient within +-255;
+    // the denominator is shifted into the table range together with the numerator,
+    // so the quotient has ~8 significant bits, off by at most one, rounded towards zero
+    int divide(int numerator, int denominator) {
+        bool negative = numerator < 0;
+        if (negative) {
+            numerator = -numerator;
+        }
+        while (denominator >= RECIPROCAL_MIN * 2) {
+            denominator >>= 1;
+            numerator >>= 1;
+        }
+        while (denominator < RECIPROCAL_MIN) {
+            denominator <<= 1;
+            numerator <<= 1;
+        }
+        int quotient = (numerator * RECIPROCALS.values[denominator - RECIPROCAL_MIN]) >> RECIPROCAL_BITS;
+        return negative ? -quotient : quotient;
+    }
+
+}
@@ -1,10 +1,11 @@
-    #define WRITE_PAGE(dst, src) \
+// synchronous NVM commands, for the mover only; everything else goes through flash::engine
+    #define ERASE_ROW(dst) \
   \
-        if ((int)dst % (PAGES_PER_ROW * PAGE_SIZE) == 0) {  \
-            target::NVMCTRL.ADDR.setADDR((int)dst >> 1);  \
-            target::NVMCTRL.CTRLA = target::NVMCTRL.CTRLA.bare().setCMD(target::nvmctrl::CTRLA::CMD::ER).setCMDEX(target::nvmctrl::CTRLA::CMDEX::KEY);  \
-            while (target::NVMCTRL.INTFLAG.getREADY() == 0);  \
-        }  \
+        target::NVMCTRL.ADDR.setADDR((int)dst >> 1);  \
+        target::NVMCTRL.CTRLA = target::NVMCTRL.CTRLA.bare().setCMD(target::nvmctrl::CTRLA::CMD::ER).setCMDEX(target::nvmctrl::CTRLA::CMDEX::KEY);  \
+        while (target::NVMCTRL.INTFLAG.getREADY() == 0);
+
+    #define PROGRAM_PAGE(dst, src) \
   \
         target::NVMCTRL.CTRLB.setMANW(true);  \
         target::NVMCTRL.ADDR.setADDR((int)dst >> 1);  \
@@ -20,21 +21,254 @@ namespace flash {
     const int PAGE_SIZE = 64;
     const int PAGES_PER_ROW = 4;
 
-    void writePage(void* dst, void* src) {
-        WRITE_PAGE(dst, src);
+    const int JOB_QUEUE_SIZE = 4;
+
+    // interrupts off, returns the previous state for restoreInterrupts(), works in interrupts too
+    inline unsigned int disableInterrupts() {
+        unsigned int primask;
+        asm volatile("mrs %0, primask\n cpsid i" : "=r"(primask) :: "memory");
+        return primask;
+    }
+
+    inline void restoreInterrupts(unsigned int primask) {
+        asm volatile("msr primask, %0" :: "r"(primask) : "memory");
     }
 
+    /*
+     * FlashEngine - programs pages without waiting for the NVM controller
+     *
+     * writePage() queues a job and returns. The engine issues the row erase
+     * (for the first page of a row), a page buffer clear (for a partial page)
+     * and the page write one after another,
+     * each started from the NVMCTRL READY interrupt of the previous one, and
+     * on completion counts the job in the caller's counter and schedules the
+     * caller's event. The source must stay untouched until then.
+     *
+     * The source is loaded into the NVM page buffer only when the write is
+     * issued, straight from where the caller keeps it, so callers need no
+     * page sized copy. A partial page is loaded up to its last word, the
+     * rest of the page stays erased.
+     *
+     * The CPU stalls on flash reads while the controller is busy, but
+     * interrupts are served between the phases, DMA and USB hardware keep
+     * going, and nothing sits in a loop waiting for READY.
+     *
+     * Jobs may be queued from the application loop and from interrupts.
+     */
+    class FlashEngine {
+
+        static const int STATE_IDLE = 0;
+        static const int STATE_ERASING = 1;
+        static const int STATE_CLEARING = 2;
+        static const int STATE_WRITING = 3;
+
+        struct Job {
+            void* dst;
+            const void* src;
+            int length;
+            volatile unsigned int* completions;
+            int eventId;
+        };
+
+        Job jobs[JOB_QUEUE_SIZE];
+        volatile unsigned int head = 0;
+        volatile unsigned int tail = 0;
+        volatile int state = STATE_IDLE;
+
+        void command(target::nvmctrl::CTRLA::CMD cmd) {
+            target::NVMCTRL.CTRLA = target::NVMCTRL.CTRLA.bare().setCMD(cmd).setCMDEX(target::nvmctrl::CTRLA::CMDEX::KEY);
+            target::NVMCTRL.INTENSET.setREADY(true);
+        }
+
+        void program(Job* job) {
+            target::NVMCTRL.ADDR.setADDR((int)job->dst >> 1);
+            unsigned int* dst = (unsigned int*)job->dst;
+            const unsigned int* src = (const unsigned int*)job->src;
+            for (int remaining = job->length; remaining > 0; remaining -= 4) {
+                unsigned int word = *src++;
+                if (remaining < 4) {
+                    // bytes past the end stay erased
+                    word |= 0xFFFFFFFF << (remaining * 8);
+                }
+                *dst++ = word;
+            }
+            state = STATE_WRITING;
+            command(target::nvmctrl::CTRLA::CMD::WP);
+        }
+
+        // a partial page must not pick up what an earlier load left in the page buffer
+        void load(Job* job) {
+            if (job->length < PAGE_SIZE && state != STATE_CLEARING) {
+                state = STATE_CLEARING;
+                command(target::nvmctrl::CTRLA::CMD::PBC);
+            }
+            else {
+                program(job);
+            }
+        }
+
+        void startJob() {
+            Job* job = &jobs[head % JOB_QUEUE_SIZE];
+            if ((int)job->dst % (PAGES_PER_ROW * PAGE_SIZE) == 0) {
+                target::NVMCTRL.ADDR.setADDR((int)job->dst >> 1);
+                state = STATE_ERASING;
+                command(target::nvmctrl::CTRLA::CMD::ER);
+            }
+            else {
+                load(job);
+            }
+        }
+
+        // the controller finished the current phase
+        void step() {
+            Job* job = &jobs[head % JOB_QUEUE_SIZE];
+
+            if (state == STATE_ERASING || state == STATE_CLEARING) {
+                load(job);
+                return;
+            }
+
+            (*job->completions)++;
+            applicationEvents::schedule(job->eventId);
+            head++;
+            state = STATE_IDLE;
+
+            if (head != tail) {
+                startJob();
+            }
+        }
+
+    public:
+
+        void init() {
+            target::NVMCTRL.CTRLB.setMANW(true);
+            target::NVIC.ISER.setSETENA(1 << target::interrupts::External::NVMCTRL);
+        }
+
+        // writes length bytes (up to PAGE_SIZE) from a word aligned src, false if the queue is full
+        bool writePage(void* dst, const void* src, int length, volatile unsigned int* completions, int eventId) {
+            unsigned int primask = disableInterrupts();
+            bool queued = tail - head < JOB_QUEUE_SIZE;
+            if (queued) {
+                Job* job = &jobs[tail % JOB_QUEUE_SIZE];
+                job->dst = dst;
+                job->src = src;
+                job->length = length;
+                job->completions = completions;
+                job->eventId = eventId;
+                tail++;
+                if (state == STATE_IDLE) {
+                    startJob();
+                }
+            }
+            restoreInterrupts(primask);
+            return queued;
+        }
+
+        // drives the queue without the interrupt, for callers that have to wait for it,
+        // from the main loop or from interrupts
+        void poll() {
+            // READY is checked with interrupts masked: otherwise the NVMCTRL interrupt could
+            // issue the next command after the check, and step() would run again while it's busy
+            unsigned int primask = disableInterrupts();
+            // READY stays set until the next command, so the interrupt is enabled per command
+            if (target::NVMCTRL.INTFLAG.getREADY()) {
+                target::NVMCTRL.INTENCLR.setREADY(true);
+                if (state != STATE_IDLE) {
+                    step();
+                }
+            }
+            restoreInterrupts(primask);
+        }
+
+        void waitIdle() {
+            while (state != STATE_IDLE) {
+                poll();
+            }
+        }
+
+        void interruptHandlerNVMCTRL() {
+            // may be left pending by a phase poll() already finished
+            poll();
+        }
+    };
+
+    FlashEngine engine;
+
+    const unsigned int INSTALL_STATISTICS_MAGIC = 0x53544154;
+    const int MOVER_WRITE_ATTEMPTS = 3;
+
+    // what the last install did, kept in RAM over the reset (.noinit) for the new firmware to report
+    struct InstallStatistics {
+        unsigned int magic;         // INSTALL_STATISTICS_MAGIC, cleared once taken by FirmwareUpdate, anything else after power up
+        unsigned short rowsErased;  // rows erased and programmed, retries included
+        unsigned short rowsSkipped; // rows already identical to the new image
+        unsigned short rowsRetried; // rows programmed again after a read back mismatch
+        unsigned short rowsFailed;  // rows still different after MOVER_WRITE_ATTEMPTS
+    };
+
+    __attribute__((section(".noinit"))) InstallStatistics installStatistics;
+
     extern "C" void (*moveAndReset)(void* dst, void* src, int pages);
 
+    /*
+     * Runs from the upload area and overwrites the running image with the new one.
+     * Nothing outside .mover may be called, everything is inlined.
+     *
+     * Rows already holding the new content are left alone. Every programmed
+     * row is read back and programmed again if it doesn't match.
+     */
     __attribute__((section(".mover"))) void myMoverFnc(void* dst, void* src, int pages) {
 
         asm volatile("cpsid i");
 
-        for (int page = 0; page < pages; page++) {
-            int offset = page * flash::PAGE_SIZE;
-            WRITE_PAGE((void*)((int)dst + offset), (void*)((int)src + offset));
+        InstallStatistics* statistics = &installStatistics;
+        statistics->rowsErased = 0;
+        statistics->rowsSkipped = 0;
+        statistics->rowsRetried = 0;
+        statistics->rowsFailed = 0;
+
+        int size = pages * PAGE_SIZE;
+
+        for (int row = 0; row < size; row += PAGES_PER_ROW * PAGE_SIZE) {
+            unsigned int* dstRow = (unsigned int*)((int)dst + row);
+            unsigned int* srcRow = (unsigned int*)((int)src + row);
+            int rowSize = size - row < PAGES_PER_ROW * PAGE_SIZE ? size - row : PAGES_PER_ROW * PAGE_SIZE;
+
+            for (int attempt = 0; ; attempt++) {
+
+                bool same = true;
+                for (int i = 0; i < rowSize >> 2; i++) {
+                    if (dstRow[i] != srcRow[i]) {
+                        same = false;
+                        break;
+                    }
+                }
+
+                if (same) {
+                    if (attempt == 0) {
+                        statistics->rowsSkipped++;
+                    }
+                    break;
+                }
+                if (attempt == MOVER_WRITE_ATTEMPTS) {
+                    statistics->rowsFailed++;
+                    break;
+                }
+                if (attempt > 0) {
+                    statistics->rowsRetried++;
+                }
+
+                ERASE_ROW(dstRow);
+                for (int offset = 0; offset < rowSize; offset += PAGE_SIZE) {
+                    PROGRAM_PAGE((void*)((int)dstRow + offset), (void*)((int)srcRow + offset));
+                }
+                statistics->rowsErased++;
+            }
         }
 
+        statistics->magic = INSTALL_STATISTICS_MAGIC;
+
         #define AIRCR (*(volatile unsigned int*)0xE000ED0C)
         #define AIRCR_VECTKEY_MASK 0x05FA0000  // VECTKEY, needed to write to the AIRCR
         #define SYSRESETREQ_BIT    0x00000004  // SYSRESETREQ bit position
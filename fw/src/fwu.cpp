@@ -2,25 +2,275 @@ const int FWU_UPLOAD_BASE_ADDRESS = 0x2000;
 const int FWU_UPLOAD_MAX_PAGES = (0x2000 - flash::PAGES_PER_ROW * flash::PAGE_SIZE) / flash::PAGE_SIZE; // last row in flash memory is reserved for configuration
 const unsigned short CRC16_SEED = 0x1234;
 
+// PAC1 write protection bit of the DSU, protected after reset
+const unsigned int PAC1_WP_DSU = 1 << 1;
 
-class FirmwareUpdate {
-    int pagesWritten = 0;
+const int FWU_PAGE_BUFFERS = 2;
+const int FWU_RECEIPT_BYTES = (FWU_UPLOAD_MAX_PAGES + 7) / 8;
 
+// receives raw pages into the page buffers of FirmwareUpdate
+class PageReceiver {
 public:
-    void prepare(int pages) {
-        pagesWritten = 0;
+    // a buffer was freed, getPageBuffer() may have one now
+    virtual void pageBufferFreed() = 0;
+};
+
+/*
+ * FirmwareUpdate - stores an uploaded image at FWU_UPLOAD_BASE_ADDRESS
+ *
+ * Packets of the upload endpoint are passed to receive() from the main
+ * loop, the endpoint NAKs while one is waiting there (FwuEndpoint). A raw
+ * page is received straight into one of FWU_PAGE_BUFFERS buffers, the one
+ * getPageBuffer() returns, and queued from there to flash::engine, so the
+ * endpoint takes the next page while flash is busy with the previous one.
+ * When the engine reports a page done, onEvent() reads it back, frees its
+ * buffer and tells the PageReceiver, which holds off the host while no
+ * buffer is free. A page received elsewhere is copied to a buffer, waiting
+ * for the engine if all are taken. Nothing here runs in the USB interrupt:
+ * a well compressed packet can take many page programming times.
+ *
+ * A compressed image is decoded as its packets arrive, straight into the
+ * page buffers, until the page count given to prepare() is complete. Page
+ * count and CRC always describe the decompressed image.
+ *
+ * Each programmed page that reads back right is marked in a receipt bitmap.
+ * An interrupted upload is resumed by seek() to the first page of a row
+ * with pages missing and sending raw pages from there: programming the
+ * first page of a row erases the whole row, so its pages are sent again
+ * together. The bitmap and the tag given to prepare() survive anything but
+ * a power loss or the next prepare().
+ */
+class FirmwareUpdate : public applicationEvents::EventHandler, public ByteSink {
+    int programEventId;
+
+    // word aligned, the NVM page buffer is loaded a word at a time
+    unsigned char buffers[FWU_PAGE_BUFFERS][flash::PAGE_SIZE] __attribute__((aligned(4)));
+    unsigned short bufferPages[FWU_PAGE_BUFFERS];  // where each buffer goes
+    // buffers go through these stages in the order filled
+    volatile unsigned int buffersFilled = 0;       // page received
+    volatile unsigned int buffersSubmitted = 0;    // queued to flash::engine
+    volatile unsigned int buffersCompleted = 0;    // programmed, counted by flash::engine
+    volatile unsigned int buffersProgrammed = 0;   // read back, buffer free
+
+    unsigned int pagesExpected = 0;
+    unsigned int nextPage = 0;    // page the next data received goes to
+    unsigned int tag = 0;         // identifies the image to the host, opaque here
+    unsigned char receipts[FWU_RECEIPT_BYTES];
+
+    bool compressed = false;
+    LzDecoder decoder;
+    int pageFill = 0; // bytes decoded into the buffer after the last filled one
+
+    PageReceiver* receiver = NULL;
+
+    // of the install that started this firmware, latched by init()
+    flash::InstallStatistics installStatistics;
+    bool installed = false;
+
+    unsigned char* pageAddress(int page) {
+        return (unsigned char*)(FWU_UPLOAD_BASE_ADDRESS + page * flash::PAGE_SIZE);
+    }
+
+    void submitPages() {
+        unsigned int primask = flash::disableInterrupts();
+        while (buffersSubmitted != buffersFilled) {
+            int slot = buffersSubmitted % FWU_PAGE_BUFFERS;
+            int page = bufferPages[slot];
+            if (!flash::engine.writePage(pageAddress(page), buffers[slot], flash::PAGE_SIZE, &buffersCompleted, programEventId)) {
+                // queue full, retried when one of our pages completes
+                break;
+            }
+            if ((page & (flash::PAGES_PER_ROW - 1)) == 0) {
+                // the row gets erased, its other pages with it
+                for (int i = 0; i < flash::PAGES_PER_ROW; i++) {
+                    receipts[(page + i) >> 3] &= ~(1 << ((page + i) & 7));
+                }
+            }
+            buffersSubmitted++;
+        }
+        flash::restoreInterrupts(primask);
+    }
+
+    // reads back the pages the engine has finished and frees their buffers
+    void completePages() {
+        unsigned int primask = flash::disableInterrupts();
+        bool freed = buffersProgrammed != buffersCompleted;
+        while (buffersProgrammed != buffersCompleted) {
+            int slot = buffersProgrammed % FWU_PAGE_BUFFERS;
+            int page = bufferPages[slot];
+            unsigned char* address = pageAddress(page);
+
+            bool valid = true;
+            for (int i = 0; i < flash::PAGE_SIZE; i++) {
+                if (address[i] != buffers[slot][i]) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (valid) {
+                receipts[page >> 3] |= 1 << (page & 7);
+            }
+
+            buffersProgrammed++;
+        }
+        flash::restoreInterrupts(primask);
+
+        if (freed && receiver) {
+            receiver->pageBufferFreed();
+        }
+    }
+
+    // true if there's room for another page, waits for a free buffer if needed
+    bool reservePage() {
+        if (nextPage >= pagesExpected) {
+            return false;
+        }
+        while (buffersFilled - buffersProgrammed == FWU_PAGE_BUFFERS) {
+            submitPages();
+            flash::engine.poll();
+            completePages();
+        }
+        return true;
+    }
+
+    void fillBuffer() {
+        bufferPages[buffersFilled % FWU_PAGE_BUFFERS] = nextPage++;
+        asm volatile("" ::: "memory");
+        buffersFilled++;
+        submitPages();
+    }
+
+public:
+    void init(PageReceiver* receiver) {
+        this->receiver = receiver;
+        programEventId = applicationEvents::createEventId();
+        handle(programEventId);
+
+        // taken once: the statistics stay in RAM over any reset but a power loss,
+        // and a later reset without an install must not report them again
+        if (flash::installStatistics.magic == flash::INSTALL_STATISTICS_MAGIC) {
+            installStatistics = flash::installStatistics;
+            installed = true;
+            flash::installStatistics.magic = 0;
+        }
+    }
+
+    void prepare(int pages, bool compressed, unsigned int tag) {
+        flush();
+        pagesExpected = pages < FWU_UPLOAD_MAX_PAGES ? pages : FWU_UPLOAD_MAX_PAGES;
+        nextPage = 0;
+        this->tag = tag;
+        for (int i = 0; i < FWU_RECEIPT_BYTES; i++) {
+            receipts[i] = 0;
+        }
+        this->compressed = compressed;
+        decoder.reset(this);
+        pageFill = 0;
+    }
+
+    // raw pages from here on go to the given page, false unless it starts a row
+    bool seek(int page) {
+        if ((page & (flash::PAGES_PER_ROW - 1)) != 0 || page >= pagesExpected) {
+            return false;
+        }
+        nextPage = page;
+        compressed = false;
+        pageFill = 0;
+        return true;
+    }
+
+    // the buffer the next raw page is to be received into, NULL if all are taken
+    unsigned char* getPageBuffer() {
+        if (buffersFilled - buffersProgrammed == FWU_PAGE_BUFFERS) {
+            return NULL;
+        }
+        return buffers[buffersFilled % FWU_PAGE_BUFFERS];
+    }
+
+    // true if raw pages are expected, they go to getPageBuffer()
+    bool isReceivingPages() {
+        return !compressed && nextPage < pagesExpected;
+    }
+
+    bool isCompressed() {
+        return compressed;
+    }
+
+    // a packet from the upload endpoint, from the main loop
+    void receive(unsigned char* data, int length) {
+        if (compressed) {
+            decoder.decode(data, length);
+        }
+        else if (length == flash::PAGE_SIZE) {
+            // the host pads the last page
+            write(data);
+        }
+    }
+
+    void put(unsigned char byte) {
+        if (pageFill == 0 && !reservePage()) {
+            return;
+        }
+        buffers[buffersFilled % FWU_PAGE_BUFFERS][pageFill++] = byte;
+        if (pageFill == flash::PAGE_SIZE) {
+            pageFill = 0;
+            fillBuffer();
+        }
     }
 
     void write(unsigned char* page) {
-        if (pagesWritten < FWU_UPLOAD_MAX_PAGES) {
-            flash::writePage((void*)(FWU_UPLOAD_BASE_ADDRESS + pagesWritten * flash::PAGE_SIZE), page);
-            pagesWritten++;
+        if (reservePage()) {
+            unsigned char* buffer = buffers[buffersFilled % FWU_PAGE_BUFFERS];
+            // a page received into getPageBuffer() is in place already
+            if (page != buffer) {
+                for (int i = 0; i < flash::PAGE_SIZE; i++) {
+                    buffer[i] = page[i];
+                }
+            }
+            fillBuffer();
         }
     }
 
+    // waits for pages still buffered, before the image is checked
+    void flush() {
+        while (buffersProgrammed != buffersFilled) {
+            submitPages();
+            flash::engine.poll();
+            completePages();
+        }
+    }
+
+    void onEvent() {
+        completePages();
+        submitPages();
+    }
+
+    int getPagesExpected() {
+        return pagesExpected;
+    }
+
+    unsigned int getTag() {
+        return tag;
+    }
+
+    // bit per page, lowest bit first, set if the page is programmed and valid
+    const unsigned char* getReceipts() {
+        return receipts;
+    }
+
+    bool isComplete() {
+        for (int page = 0; page < pagesExpected; page++) {
+            if (!(receipts[page >> 3] & (1 << (page & 7)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // XOR of 16-bit words, as sent by tools older than firmware 1.1
     bool checkCrc(unsigned short theirCrc16) {
         unsigned short ourCrc16 = CRC16_SEED;
-        for (int offset = 0; offset < pagesWritten * flash::PAGE_SIZE; offset += 2) {
+        for (int offset = 0; offset < pagesExpected * flash::PAGE_SIZE; offset += 2) {
             unsigned short i = *(unsigned short*)(FWU_UPLOAD_BASE_ADDRESS + offset);
             ourCrc16 = ourCrc16 ^ i;
         }
@@ -28,8 +278,37 @@ public:
         return ourCrc16 == theirCrc16;
     }
 
+    // IEEE 802.3 CRC32 of the uploaded image, computed by the Device Service Unit
+    bool checkCrc32(unsigned int theirCrc32) {
+
+        target::PAC1.WPCLR.setWP(PAC1_WP_DSU);
+
+        target::DSU.STATUSA.setDONE(true).setBERR(true);
+        target::DSU.ADDR = target::DSU.ADDR.bare().setADDR(FWU_UPLOAD_BASE_ADDRESS >> 2);
+        target::DSU.LENGTH = target::DSU.LENGTH.bare().setLENGTH(pagesExpected * flash::PAGE_SIZE >> 2);
+        target::DSU.DATA.setDATA(0xFFFFFFFF);
+        target::DSU.CTRL = target::DSU.CTRL.bare().setCRC(true);
+
+        while (!target::DSU.STATUSA.getDONE());
+
+        bool busError = target::DSU.STATUSA.getBERR();
+        // DSU leaves out the final inversion
+        unsigned int ourCrc32 = ~target::DSU.DATA.getDATA();
+
+        target::PAC1.WPSET.setWP(PAC1_WP_DSU);
+
+        return !busError && ourCrc32 == theirCrc32;
+    }
+
+    // statistics of the install that started this firmware, NULL if it was started otherwise
+    const flash::InstallStatistics* getInstallStatistics() {
+        return installed ? &installStatistics : NULL;
+    }
+
     void install() {
-        (*flash::moveAndReset)((void*)0x0000, (void*)FWU_UPLOAD_BASE_ADDRESS, pagesWritten);
+        // the mover takes over the NVM controller
+        flash::engine.waitIdle();
+        (*flash::moveAndReset)((void*)0x0000, (void*)FWU_UPLOAD_BASE_ADDRESS, pagesExpected);
     }
 
 };
@@ -1,3 +1,10 @@
+// Decoder scheduling, selected at build time:
+//   0 - decode on a 20ms timer, whatever the sensor is doing
+//   1 - decode every frame as soon as the sensor publishes it
+#ifndef GESTURE_EVENT_DRIVEN
+#define GESTURE_EVENT_DRIVEN 1
+#endif
+
 /*
  * GestureDecoder - Detects and reports touch gestures
  *
@@ -18,64 +25,133 @@
  *   - Slide gesture function can be configured via CLI:
  *     ssc set function volume|scroll|brightness
  *
- * Timing Constants:
+ * Timing Constants (timebase ticks, measured on frame capture timestamps):
  *   - TAP_MAX_DURATION: Maximum touch duration to count as a tap (300ms)
  *   - DOUBLE_TAP_WINDOW: Maximum time between taps for double-tap (400ms)
+ *
+ * Finger position is interpolated between channels in 1/32 channel steps
+ * (256 positions along the strip). Slide movement passes DirectionFilter in
+ * these fine units; the scaled result is reported in whole steps on the frame
+ * it is decoded in, the remainder carries over to the next frame. Scrolling
+ * hosts that set the HID Resolution Multiplier get steps of a fraction of a
+ * channel instead.
  */
-class GestureDecoder : public genericTimer::Timer {
+class GestureDecoder : public genericTimer::Timer, public applicationEvents::EventHandler {
 
     TouchSensor* touchSensor;
     KeyReporter* keyReporter;
     DeviceConfiguration* deviceConfiguration;
+    ConfigSnapshot config;
 
+    static const int POSITION_SHIFT = 5; // fine positions per channel: 1 << 5
     int oldFingerPos = -1;
+    int touchStartPos = 0;
+    int slideResidue = 0;   // scaled fine movement not reported yet
+
+    TouchFrame frame;
+    unsigned int frameSequence = 0;
 
-    static const int queueSize = 4;
-    signed char queue[queueSize];
+    int frameEventId;
+
+    // a quarter channel of jitter at scale 1
+    DirectionFilter<1 << (POSITION_SHIFT - 2)> directionFilter;
 
     // Tap detection state
-    // Timer runs every 20ms (start(2) = 2 * 10ms = 20ms)
-    static const int TAP_MAX_DURATION = 15;    // 15 * 20ms = 300ms max touch duration for tap
-    static const int DOUBLE_TAP_WINDOW = 20;   // 20 * 20ms = 400ms window for second tap
-    int touchStartTime = 0;          // Timer ticks when touch began
-    int lastTapTime = 0;             // Timer ticks when last tap was released
-    int currentTime = 0;             // Running timer counter
+    static const unsigned int TAP_MAX_DURATION = 300 * timebase::TICKS_PER_SECOND / 1000;
+    static const unsigned int DOUBLE_TAP_WINDOW = 400 * timebase::TICKS_PER_SECOND / 1000;
+    unsigned int touchStartTime = 0; // Time when touch began
+    unsigned int lastTapTime = 0;    // Time when last tap was released
+    unsigned int currentTime = 0;    // Capture time of the last decoded frame
     bool hasMoved = false;           // Whether finger moved during this touch
     bool isTouching = false;         // Current touch state
     bool waitingForDoubleTap = false; // Waiting for potential second tap
     bool releaseProcessed = true;    // Track if we've processed the finger release
 
     void onTimer() {
+#if GESTURE_EVENT_DRIVEN
+        // startup delay is over, from now on each published frame schedules onEvent()
+        touchSensor->setFrameEventId(frameEventId);
+#else
+        decode();
+
+        // check every 20ms
+        start(clocks::timerTicks(20));
+#endif
+    }
+
+    void onEvent() {
+        decode();
+    }
 
-        currentTime++;
-        checkSensor();
+    void decode() {
+        decodeCycles.start();
+
+        // one consistent view of the configuration for the whole frame
+        config = *deviceConfiguration->getSnapshot();
+
+        if (!checkSensor()) {
+            return;
+        }
         checkTap();
-        optimizeQueue();
-        checkQueue();
 
-        // check every 20ms
-        start(2);
+        // frames decoded only, a call finding no new frame is not counted
+        decodeCycles.stop();
+    }
+
+    // finger position around the strongest channel in 1 << POSITION_SHIFT steps per channel,
+    // offset from the channel by the centroid of the channel and its neighbours
+    int interpolatePosition(int maxIndex, int channelCount) {
+        // drop filter fraction, so the shifted difference fits in 32 bits
+        int left = maxIndex > 0 ? frame.channels[maxIndex - 1] >> 8 : 0;
+        int center = frame.channels[maxIndex] >> 8;
+        int right = maxIndex < channelCount - 1 ? frame.channels[maxIndex + 1] >> 8 : 0;
+
+        int position = maxIndex << POSITION_SHIFT;
+        int sum = left + center + right;
+        if (sum > 0) {
+#if DIVISION_FREE
+            position += fixedPoint::divide((right - left) << POSITION_SHIFT, sum);
+#else
+            position += ((right - left) << POSITION_SHIFT) / sum;
+#endif
+        }
+        return position;
     }
 
-    void checkSensor() {
+    // decodes the latest frame, returns false if there was no new one
+    bool checkSensor() {
+
+        // decode whole frames only, a frame never mixes samples from different scans
+        if (!touchSensor->readFrame(&frame, frameSequence)) {
+            return false;
+        }
+        if (frameSequence != 0) {
+            framesMissed += frame.sequence - frameSequence - 1;
+        }
+        frameSequence = frame.sequence;
+        currentTime = frame.timestamp;
 
         int max = 0;
-        int avg = 0;
+        int sum = 0;
         int maxIndex = 0;
         int channelCount = touchSensor->getChannelCount();
         for (int i = 0; i < channelCount; i++) {
-            int v = touchSensor->getChannel(i);
-            avg += v;
+            int v = frame.channels[i];
+            sum += v;
             if (v > max) {
                 max = v;
                 maxIndex = i;
             }
         }
-        avg = avg / channelCount;
 
         int newFingerPos;
-        if (max > avg * 2) {
-            newFingerPos = maxIndex;
+#if DIVISION_FREE
+        // max > 2 * average, without dividing the sum by channelCount
+        if (max * channelCount > sum * 2) {
+#else
+        if (max > sum / channelCount * 2) {
+#endif
+            newFingerPos = interpolatePosition(maxIndex, channelCount);
         }
         else {
             newFingerPos = -1;
@@ -86,11 +162,15 @@ class GestureDecoder : public genericTimer::Timer {
             // Finger just touched
             isTouching = true;
             touchStartTime = currentTime;
+            touchStartPos = newFingerPos;
             hasMoved = false;
             releaseProcessed = false;  // Reset for new touch
+            directionFilter.reset();
+            slideResidue = 0;
         } else if (newFingerPos < 0 && isTouching) {
-            // Finger just released - handled in checkTap()
+            // Finger just released - handled in checkTap(), the travel held back by the filter is reported here
             isTouching = false;
+            reportMovement(directionFilter.settle());
         }
 
         if (newFingerPos != oldFingerPos && newFingerPos >= 0 && oldFingerPos >= 0) {
@@ -98,18 +178,19 @@ class GestureDecoder : public genericTimer::Timer {
             int change = oldFingerPos - newFingerPos;
 
             if (change != 0) {
-                hasMoved = true;  // Mark that finger has moved (not a tap)
-
-                if (deviceConfiguration->data.fields.flip) {
-                    change = -change;
+                // Mark that finger has moved (not a tap), a wobble within one channel doesn't count
+                int distance = newFingerPos - touchStartPos;
+                if (distance >= 1 << POSITION_SHIFT || distance <= -(1 << POSITION_SHIFT)) {
+                    hasMoved = true;
                 }
-                queue[0] = change * deviceConfiguration->data.fields.scale;
 
+                reportMovement(directionFilter.filter(change * config.scale));
             }
 
         }
 
         oldFingerPos = newFingerPos;
+        return true;
     }
 
     /*
@@ -137,7 +218,7 @@ class GestureDecoder : public genericTimer::Timer {
         // Check if finger was just released (and we haven't processed it yet)
         if (!isTouching && !releaseProcessed) {
             releaseProcessed = true;  // Mark as processed
-            int touchDuration = currentTime - touchStartTime;
+            unsigned int touchDuration = currentTime - touchStartTime;
 
             // Valid tap: short duration and no movement
             if (touchDuration < TAP_MAX_DURATION && touchDuration > 0 && !hasMoved) {
@@ -161,101 +242,68 @@ class GestureDecoder : public genericTimer::Timer {
         }
     }
 
-    void optimizeQueue() {
-
-        // optimize queue to move always in one direction
-        // check optimize-queue.jpg
-
-        int positives = 0;
-        int negatives = 0;
-        for (int i = 0; i < queueSize; i++) {
-            if (queue[i] > 0) {
-                positives += queue[i];
-            }
-            if (queue[i] < 0) {
-                negatives -= queue[i];
-            }
-        }
-        int correction = positives;
-        int side = 1;
-        if (positives > negatives) {
-            correction = negatives;
-            side = -1;
-        }
+    // adds filtered, scaled fine movement to the residue and reports the whole steps in it
+    void reportMovement(int movement) {
 
+        slideResidue += movement;
 
-        for (int i = 0; i < queueSize; i++) {
-            if (queue[i] * side > 0) {
-                queue[i] = 0;
-            }
+        // a host with high-resolution scrolling takes fractions of a channel
+        int stepShift = POSITION_SHIFT;
+        if (config.slide.action == SLIDE_ACTION_SCROLL) {
+            stepShift -= keyReporter->getScrollResolutionShift();
         }
 
-        for (int i = queueSize - 1; i >= 0; i--) {
-            int v = queue[i];
-            if (v < 0) {
-                v = -v;
-            }
-
-            int c = correction;
-            if (c > v) {
-                c = v;
-            }
-
-            queue[i] += c * side;
-            correction -= c;
+        // whole steps, rounded towards zero
+        int steps = slideResidue >= 0 ? slideResidue >> stepShift : -(-slideResidue >> stepShift);
+        slideResidue -= steps << stepShift;
+        if (steps != 0) {
+            reportChange(steps);
         }
-
     }
 
-    void checkQueue() {
+    void reportChange(int change) {
 
-        // report according to the last change
-        int change = queue[queueSize - 1];
+        switch (config.slide.action) {
 
-        switch (deviceConfiguration->data.fields.function) {
-
-        case DEVICE_FUNCTION_VOLUME:
+        case SLIDE_ACTION_KEYS:
             if (change > 0) {
-                keyReporter->reportKey(KEY_VOLUME_UP, change);
+                keyReporter->reportKey(config.slide.keyIncrease, change);
             }
             if (change < 0) {
-                keyReporter->reportKey(KEY_VOLUME_DOWN, -change);
+                keyReporter->reportKey(config.slide.keyDecrease, -change);
             }
-
             break;
 
-        case DEVICE_FUNCTION_BRIGHTNESS:
-            if (change > 0) {
-                keyReporter->reportKey(KEY_BRIGHTNESS_UP, change);
-            }
-            if (change < 0) {
-                keyReporter->reportKey(KEY_BRIGHTNESS_DOWN, -change);
-            }
-
-            break;
-
-        case DEVICE_FUNCTION_SCROLL:
+        case SLIDE_ACTION_SCROLL:
             keyReporter->reportScroll(change);
             break;
-        }
 
-        // shift queue
-        for (int i = queueSize - 2; i >= 0; i--) {
-            queue[i + 1] = queue[i];
+        case SLIDE_ACTION_VOLUME:
+            keyReporter->reportVolume(change);
+            break;
         }
-        queue[0] = 0;
 
     }
 
 
 public:
+    clocks::CycleMeter decodeCycles;
+    // frames published by the sensor but never decoded, reported by CFG_REQUEST_GET_EVENTS;
+    // when polling slower than the sensor scans this grows steadily
+    unsigned int framesMissed = 0;
+
     void init(TouchSensor* touchSensor, KeyReporter* keyReporter, DeviceConfiguration* deviceConfiguration) {
         this->touchSensor = touchSensor;
         this->keyReporter = keyReporter;
         this->deviceConfiguration = deviceConfiguration;
 
+        directionFilter.reset();
+
+        frameEventId = applicationEvents::createEventId();
+        handle(frameEventId);
+
         // give user 2 seconds to remove finger, in case he just inserted SoundSlide in the USB port
-        start(200);
+        start(clocks::timerTicks(2000));
     }
 
 };
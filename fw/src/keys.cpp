@@ -9,4 +9,7 @@ class KeyReporter {
 public:
   virtual void reportKey(int key, int count) = 0;
   virtual void reportScroll(int steps) = 0;
+  // scroll steps per wheel detent: 1 << shift
+  virtual int getScrollResolutionShift() = 0;
+  virtual void reportVolume(int steps) = 0;
 };
@@ -0,0 +1,94 @@
+const int LZ_WINDOW = 256;   // history reachable by a match, power of two
+const int LZ_MIN_MATCH = 3;  // shorter matches don't pay for their two bytes
+
+class ByteSink {
+public:
+    virtual void put(unsigned char byte) = 0;
+};
+
+/*
+ * LzDecoder - streaming decoder of the LZSS format produced by the CLI (lz.go)
+ *
+ * The stream is a sequence of groups, each a flag byte followed by eight
+ * items, the first item described by the lowest flag bit:
+ *
+ *   1 - literal: one byte, copied to the output
+ *   0 - match: two bytes, distance - 1 and length - LZ_MIN_MATCH; copies
+ *       length bytes starting distance bytes back in the output, the copy
+ *       may overlap the bytes it produces (runs)
+ *
+ * The stream may end anywhere, the consumer knows how much output to expect
+ * and ignores the rest. Input is taken in pieces of any size as it arrives;
+ * only the last LZ_WINDOW bytes of output are kept.
+ */
+class LzDecoder {
+
+    static const int STATE_FLAGS = 0;
+    static const int STATE_ITEM = 1;
+    static const int STATE_LENGTH = 2;
+
+    unsigned char window[LZ_WINDOW];
+    int windowPos;
+    int state;
+    int flags;
+    int items;    // items left in the group
+    int distance; // of the match being read
+
+    ByteSink* sink;
+
+    void output(unsigned char byte) {
+        window[windowPos] = byte;
+        windowPos = (windowPos + 1) & (LZ_WINDOW - 1);
+        sink->put(byte);
+    }
+
+    void nextItem() {
+        flags >>= 1;
+        items--;
+        state = items ? STATE_ITEM : STATE_FLAGS;
+    }
+
+public:
+
+    void reset(ByteSink* sink) {
+        this->sink = sink;
+        for (int i = 0; i < LZ_WINDOW; i++) {
+            window[i] = 0;
+        }
+        windowPos = 0;
+        state = STATE_FLAGS;
+    }
+
+    void decode(unsigned char* data, int length) {
+        for (int i = 0; i < length; i++) {
+            unsigned char byte = data[i];
+
+            switch (state) {
+
+            case STATE_FLAGS:
+                flags = byte;
+                items = 8;
+                state = STATE_ITEM;
+                break;
+
+            case STATE_ITEM:
+                if (flags & 1) {
+                    output(byte);
+                    nextItem();
+                }
+                else {
+                    distance = byte + 1;
+                    state = STATE_LENGTH;
+                }
+                break;
+
+            case STATE_LENGTH:
+                for (int count = byte + LZ_MIN_MATCH; count > 0; count--) {
+                    output(window[(windowPos - distance) & (LZ_WINDOW - 1)]);
+                }
+                nextItem();
+                break;
+            }
+        }
+    }
+};
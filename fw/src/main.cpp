@@ -5,7 +5,7 @@ public:
   HidInterface hidInterface;
   CfgInterface cfgInterface;
 
-  UsbControlEndpoint controlEndpoint;
+  ControlEndpoint controlEndpoint;
 
   UsbInterface* getInterface(int index) {
     switch (index) {
@@ -17,6 +17,14 @@ public:
 
   UsbEndpoint* getControlEndpoint() { return &controlEndpoint; };
 
+  void interruptHandlerUSB() {
+    // seen before the library handles the bus reset
+    if (target::USB.DEVICE.INTFLAG.getEORST()) {
+      hidInterface.hidEndpoint.reset();
+    }
+    atsamd::usbd::AtSamdUsbDevice::interruptHandlerUSB();
+  }
+
   void checkDescriptor(DeviceDescriptor* deviceDescriptor) {
     deviceDescriptor->idVendor = 0xF5A2;
     deviceDescriptor->idProduct = 0x0001;
@@ -33,23 +41,48 @@ public:
   void reportScroll(int steps) {
     this->hidInterface.hidEndpoint.reportScroll(steps);
   }
+
+  int getScrollResolutionShift() {
+    return this->hidInterface.hidEndpoint.getScrollResolutionShift();
+  }
+
+  void reportVolume(int steps) {
+    this->hidInterface.hidEndpoint.reportVolume(steps);
+  }
 };
 
 GestureDecoder gestureDecoder;
+#if TOUCH_SCAN_DMA
+ScanningTouchSensor touchSensor;
+#else
 ResistiveTouchSensor touchSensor;
+#endif
 SoundSlideUsbDevice usbDevice;
 
 void interruptHandlerUSB() { usbDevice.interruptHandlerUSB(); }
+void interruptHandlerNVMCTRL() { flash::engine.interruptHandlerNVMCTRL(); }
+#if TOUCH_SCAN_DMA
+void interruptHandlerDMAC() { touchSensor.interruptHandlerDMAC(); }
+#else
 void interruptHandlerADC() { touchSensor.interruptHandlerADC(); }
+#endif
 
 void initApplication() {
   atsamd::safeboot::init(9, false, LED_PIN);
 
-  usbDevice.useInternalOscillators();
+  clocks::init();
+  flash::engine.init();
+
   usbDevice.init();
 
+  timebase::init();
+
   touchSensor.init(&usbDevice.cfgInterface.deviceConfiguration);
   gestureDecoder.init(&touchSensor, &usbDevice, &usbDevice.cfgInterface.deviceConfiguration);
+  usbDevice.cfgInterface.clockMeasurement.init(&touchSensor);
+  usbDevice.cfgInterface.touchSensor = &touchSensor;
+  usbDevice.cfgInterface.gestureDecoder = &gestureDecoder;
+  usbDevice.cfgInterface.hidEndpoint = &usbDevice.hidInterface.hidEndpoint;
 }
 
 
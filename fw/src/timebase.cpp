@@ -0,0 +1,31 @@
+/*
+ * timebase - free running 32-bit time stamp counter
+ *
+ * TC1 and TC2 form a single 32-bit counter (TC1 COUNT32 mode) clocked from
+ * the always-on OSCULP32K through a dedicated clock generator (clocks.cpp).
+ * It wraps once in ~36 hours; differences of two stamps are valid across
+ * the wrap when computed as unsigned.
+ */
+namespace timebase {
+
+    const int TICKS_PER_SECOND = clocks::TIMEBASE_HZ;
+
+    void init() {
+
+        target::PM.APBCMASK.setTC1(true).setTC2(true);
+
+        // keep COUNT synchronized, so it can be read without a read request
+        target::TC1.COUNT32.READREQ = target::TC1.COUNT32.READREQ.bare()
+            .setRCONT(true)
+            .setADDR(0x10);
+
+        target::TC1.COUNT32.CTRLA = target::TC1.COUNT32.CTRLA.bare()
+            .setMODE(target::tc::COUNT32::CTRLA::MODE::COUNT32)
+            .setENABLE(true);
+    }
+
+    unsigned int now() {
+        return target::TC1.COUNT32.COUNT.getCOUNT();
+    }
+
+}
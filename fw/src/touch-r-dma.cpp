@@ -0,0 +1,108 @@
+const int DMAC_TRIGSRC_ADC_RESRDY = 0x12;
+const int TOUCH_DMA_CHANNEL = 0;
+
+// DMAC descriptor layout (BTCTRL bits)
+const unsigned short DMAC_BTCTRL_VALID = 1 << 0;
+const unsigned short DMAC_BTCTRL_BLOCKACT_INT = 1 << 3;
+const unsigned short DMAC_BTCTRL_BEATSIZE_HWORD = 1 << 8;
+const unsigned short DMAC_BTCTRL_DSTINC = 1 << 11;
+
+struct __attribute__((packed, aligned(16))) DmacDescriptor {
+    unsigned short btctrl;
+    unsigned short btcnt;
+    unsigned int srcaddr;
+    unsigned int dstaddr; // end of the block if incrementing
+    unsigned int descaddr;
+};
+
+// DMAC base and write-back sections, one entry per channel (we use just the first one)
+DmacDescriptor dmacBaseDescriptors[TOUCH_DMA_CHANNEL + 1];
+DmacDescriptor dmacWriteBackDescriptors[TOUCH_DMA_CHANNEL + 1];
+
+/*
+ * ScanningTouchSensor - ResistiveTouchSensor without per-sample interrupts
+ *
+ * The ADC runs free with INPUTSCAN set, so it converts PIN0..PIN7 in a loop
+ * on its own, incrementing INPUTOFFSET after every result. Each RESRDY
+ * triggers one DMAC beat moving the result to RAM. Two linked descriptors
+ * alternate between two frame buffers, so the DMAC never stops and frames
+ * stay aligned to channel 0. The block interrupt (TCMPL) is the only
+ * interrupt taken, once per complete frame of all channels.
+ *
+ * INPUTCTRL.GAIN is shared by the whole scan and cannot follow a channel,
+ * so this sensor keeps the DIV2 gain; hardware averaging still applies.
+ */
+class ScanningTouchSensor : public ResistiveTouchSensor {
+
+    unsigned short frames[2][SENSOR_CHANNELS];
+    DmacDescriptor secondDescriptor;
+    int completedFrame = 0;
+
+    void initDescriptor(DmacDescriptor* descriptor, unsigned short* frame, DmacDescriptor* next) {
+        descriptor->btctrl = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BLOCKACT_INT | DMAC_BTCTRL_BEATSIZE_HWORD | DMAC_BTCTRL_DSTINC;
+        descriptor->btcnt = SENSOR_CHANNELS;
+        descriptor->srcaddr = (unsigned int)&target::ADC.RESULT;
+        descriptor->dstaddr = (unsigned int)(frame + SENSOR_CHANNELS);
+        descriptor->descaddr = (unsigned int)next;
+    }
+
+public:
+
+    void init(DeviceConfiguration* deviceConfiguration) {
+
+        this->deviceConfiguration = deviceConfiguration;
+
+        initPins();
+        initAdc();
+
+        target::ADC.CTRLB.setFREERUN(true);
+        target::ADC.INPUTCTRL.setMUXPOS(ADC_INPUTS[0]).setINPUTSCAN(SENSOR_CHANNELS - 1).setINPUTOFFSET(0);
+
+        target::PM.AHBMASK.setDMAC(true);
+        target::PM.APBBMASK.setDMAC(true);
+
+        DmacDescriptor* firstDescriptor = &dmacBaseDescriptors[TOUCH_DMA_CHANNEL];
+        initDescriptor(firstDescriptor, frames[0], &secondDescriptor);
+        initDescriptor(&secondDescriptor, frames[1], firstDescriptor);
+
+        target::DMAC.BASEADDR.setBASEADDR((unsigned int)dmacBaseDescriptors);
+        target::DMAC.WRBADDR.setWRBADDR((unsigned int)dmacWriteBackDescriptors);
+        target::DMAC.CTRL = target::DMAC.CTRL.bare()
+            .setDMAENABLE(true)
+            .setLVLEN0(true);
+
+        target::DMAC.CHID.setID(TOUCH_DMA_CHANNEL);
+        target::DMAC.CHCTRLB = target::DMAC.CHCTRLB.bare()
+            .setTRIGSRC(DMAC_TRIGSRC_ADC_RESRDY)
+            .setTRIGACT(target::dmac::CHCTRLB::TRIGACT::BEAT);
+        target::DMAC.CHINTENSET.setTCMPL(true);
+        target::DMAC.CHCTRLA.setENABLE(true);
+
+        target::NVIC.ISER.setSETENA(1 << target::interrupts::External::DMAC);
+
+        // DMAC is armed before the first conversion, so frames start at channel 0
+        target::ADC.CTRLA.setENABLE(true);
+        target::ADC.SWTRIG.setSTART(true);
+    }
+
+    void interruptHandlerDMAC() {
+
+        target::DMAC.CHID.setID(TOUCH_DMA_CHANNEL);
+
+        if (target::DMAC.CHINTFLAG.getTCMPL()) {
+            isrCycles.start();
+            target::DMAC.CHINTFLAG.setTCMPL(true);
+
+            // DMAC is already filling the other buffer
+            unsigned short* frame = frames[completedFrame];
+            completedFrame ^= 1;
+
+            for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+                processSample(ch, frame[ch], 0);
+            }
+            publishFrame();
+            isrCycles.stop();
+        }
+
+    }
+};
@@ -1,3 +1,50 @@
+// ADC acquisition path, selected at build time:
+//   0 - one ADC interrupt per conversion, the ISR filters the sample and switches MUXPOS
+//   1 - ADC scans all channels on its own, DMAC moves each frame to RAM, one interrupt per frame
+#ifndef TOUCH_SCAN_DMA
+#define TOUCH_SCAN_DMA 1
+#endif
+
+// ADC resolution, selected at build time:
+//   0 - single 8-bit conversions at fixed gain, noise hidden by a strong software IIR filter
+//   1 - 16 accumulated 12-bit conversions averaged by AVGCTRL to 14 bits, light software filter
+//       (less lag), gain auto-ranged per channel with TOUCH_SCAN_DMA 0 only
+#ifndef TOUCH_ADC_OVERSAMPLING
+#define TOUCH_ADC_OVERSAMPLING 1
+#endif
+
+#if TOUCH_ADC_OVERSAMPLING
+static const int ADC_CLOCK_HZ = 1500000;
+static const int ADC_RESULT_BITS = 14;
+static const int ADC_MAX_GAIN_SHIFT = 3; // up to 4X
+static const int ADC_SMOOTHING_SHIFT = 1; // new sample weight 1/2
+#else
+static const int ADC_CLOCK_HZ = 93750;
+static const int ADC_RESULT_BITS = 8;
+static const int ADC_MAX_GAIN_SHIFT = 0; // DIV2 only
+static const int ADC_SMOOTHING_SHIFT = 2; // new sample weight 1/4
+#endif
+
+// ADC_CLOCK_HZ from clocks::ADC_HZ
+constexpr int ADC_PRESCALER = clocks::adcPrescaler(ADC_CLOCK_HZ);
+static_assert(ADC_PRESCALER <= clocks::ADC_PRESCALER_MAX, "ADC_CLOCK_HZ is below clocks::ADC_HZ / 512");
+
+// Raw results are normalised to the DIV2 range. Each gain step doubles the
+// result, so a sample taken at higher gain carries that many extra bits.
+static const int SAMPLE_BITS = ADC_RESULT_BITS + ADC_MAX_GAIN_SHIFT;
+static const int CHANNEL_FRACTION_BITS = 24 - SAMPLE_BITS;
+
+static const int ADC_RESULT_MAX = (1 << ADC_RESULT_BITS) - 1;
+static const int SAMPLE_MAX = (1 << SAMPLE_BITS) - 1;
+
+// gain shift (index) to INPUTCTRL gain, referenced to VDDANA / 2
+static const target::adc::INPUTCTRL::GAIN ADC_GAINS[] = {
+    target::adc::INPUTCTRL::GAIN::DIV2,
+    target::adc::INPUTCTRL::GAIN::_1X,
+    target::adc::INPUTCTRL::GAIN::_2X,
+    target::adc::INPUTCTRL::GAIN::_4X
+};
+
 static const int SENSOR_CHANNELS = 8;
 static const int SENSOR_PINS[SENSOR_CHANNELS] = { 2, 3, 4, 5, 6, 7, 14, 15 };
 static const target::adc::INPUTCTRL::MUXPOS ADC_INPUTS[SENSOR_CHANNELS] = {
@@ -15,23 +62,33 @@ class ResistiveTouchSensor : public TouchSensor {
 
     int channel = 0;
     int values[SENSOR_CHANNELS];
-    int sensitivity = -1;
-    int threshold;
-
-    DeviceConfiguration* deviceConfiguration;
+    unsigned char gainShifts[SENSOR_CHANNELS];
 
     void startConversion(int ch) {
         channel = ch;
-        target::ADC.INPUTCTRL.setMUXPOS(ADC_INPUTS[ch]);
+        target::ADC.INPUTCTRL.setMUXPOS(ADC_INPUTS[ch]).setGAIN(ADC_GAINS[gainShifts[ch]]);
         target::ADC.SWTRIG.setSTART(true);
     }
 
-public:
+    // picks the gain for the next conversion of the channel: step down before the
+    // result saturates, step up while the doubled result still fits below 7/8
+    int rangeGain(int result, int gainShift) {
+        if (result > ADC_RESULT_MAX - (ADC_RESULT_MAX >> 4) && gainShift > 0) {
+            return gainShift - 1;
+        }
+        if (result < (ADC_RESULT_MAX >> 4) * 7 && gainShift < ADC_MAX_GAIN_SHIFT) {
+            return gainShift + 1;
+        }
+        return gainShift;
+    }
 
-    void init(DeviceConfiguration* deviceConfiguration) {
+protected:
 
-        this->deviceConfiguration = deviceConfiguration;
+    DeviceConfiguration* deviceConfiguration;
+    TouchFrameBuffer frameBuffer;
+    volatile int frameEventId = -1;
 
+    void initPins() {
         for (int i = 0; i < SENSOR_CHANNELS; i++) {
             target::PORT.DIRCLR.setDIRCLR(1 << SENSOR_PINS[i]);
             target::PORT.PINCFG[SENSOR_PINS[i]] = target::PORT.PINCFG->bare().setPMUXEN(true);//.setPULLEN(true);
@@ -45,13 +102,12 @@ public:
             }
 
         }
+    }
 
-        // GC0 -> ADC
+    void initAdc() {
 
-        target::GCLK.CLKCTRL = target::GCLK.CLKCTRL.bare()
-            .setID(target::gclk::CLKCTRL::ID::ADC)
-            .setGEN(target::gclk::CLKCTRL::GEN::GCLK0)
-            .setCLKEN(true);
+        // generator routed by clocks::init()
+        target::adc::CTRLB::PRESCALER prescaler = (target::adc::CTRLB::PRESCALER)ADC_PRESCALER;
 
         target::PM.APBCMASK.setADC(true);
 
@@ -59,13 +115,64 @@ public:
         target::ADC.CALIB.setBIAS_CAL(target::NVMCALIB.SOFT1.getADC_BIASCAL());
 
         target::ADC.REFCTRL.setREFSEL(target::adc::REFCTRL::REFSEL::INTVCC1);
-        target::ADC.SAMPCTRL.setSAMPLEN(1);
 
-        target::ADC.CTRLB.setRESSEL(target::adc::CTRLB::RESSEL::_8BIT).setPRESCALER(target::adc::CTRLB::PRESCALER::DIV512);
+#if TOUCH_ADC_OVERSAMPLING
+        // 16 samples accumulated to 16 bits, ADJRES 2 leaves 14 bits;
+        // faster ADC clock with longer sampling keeps the frame rate and the settling time
+        target::ADC.SAMPCTRL.setSAMPLEN(15);
+        target::ADC.AVGCTRL = target::ADC.AVGCTRL.bare()
+            .setSAMPLENUM(target::adc::AVGCTRL::SAMPLENUM::_16)
+            .setADJRES(2);
+        target::ADC.CTRLB.setRESSEL(target::adc::CTRLB::RESSEL::_16BIT).setPRESCALER(prescaler);
+#else
+        target::ADC.SAMPCTRL.setSAMPLEN(1);
+        target::ADC.CTRLB.setRESSEL(target::adc::CTRLB::RESSEL::_8BIT).setPRESCALER(prescaler);
+#endif
 
         target::ADC.INPUTCTRL = target::ADC.INPUTCTRL.bare()
             .setMUXNEG(target::adc::INPUTCTRL::MUXNEG::GND)
             .setGAIN(target::adc::INPUTCTRL::GAIN::DIV2);
+    }
+
+    // converts one raw ADC result taken at the given gain to a filtered channel value
+    void processSample(int ch, int result, int gainShift) {
+
+        int value = SAMPLE_MAX - (result << (ADC_MAX_GAIN_SHIFT - gainShift));
+
+        // threshold is defined in 8-bit steps
+        if (value < deviceConfiguration->getSnapshot()->threshold << (SAMPLE_BITS - 8)) {
+            value = 0;
+        }
+
+#if DIVISION_FREE
+        // exponential moving average, new sample weighted 1 / 2^ADC_SMOOTHING_SHIFT
+        values[ch] += ((value << CHANNEL_FRACTION_BITS) - values[ch]) >> ADC_SMOOTHING_SHIFT;
+#else
+        const int smoothing = (1 << ADC_SMOOTHING_SHIFT) - 1;
+        values[ch] = ((value << CHANNEL_FRACTION_BITS) + values[ch] * smoothing) / (smoothing + 1);
+#endif
+    }
+
+    // hands the filtered values of a completed scan over to the consumer
+    void publishFrame() {
+        TouchFrame* frame = frameBuffer.next();
+        for (int ch = 0; ch < SENSOR_CHANNELS; ch++) {
+            frame->channels[ch] = values[ch];
+        }
+        frameBuffer.publish(timebase::now());
+        if (frameEventId >= 0) {
+            applicationEvents::schedule(frameEventId);
+        }
+    }
+
+public:
+
+    void init(DeviceConfiguration* deviceConfiguration) {
+
+        this->deviceConfiguration = deviceConfiguration;
+
+        initPins();
+        initAdc();
 
         target::NVIC.ISER.setSETENA(1 << target::interrupts::External::ADC);
         target::ADC.INTENSET.setRESRDY(true);
@@ -78,28 +185,21 @@ public:
     void interruptHandlerADC() {
 
         if (target::ADC.INTFLAG.getRESRDY()) {
+            isrCycles.start();
             target::ADC.INTFLAG.setRESRDY(true);
 
-            int value = 0xFF - target::ADC.RESULT.getRESULT();
-
-            if (sensitivity != deviceConfiguration->data.fields.sensitivity) {
-                sensitivity = deviceConfiguration->data.fields.sensitivity;
-                threshold = ((100 - sensitivity) * 7 / 100) + 2;
-            }
-
-            if (value < threshold || sensitivity == 0) {
-                value = 0;
-            }
-
-            const int smoothing = 3;
-            values[channel] = ((value << 16) + values[channel] * smoothing) / (smoothing + 1);
+            int result = target::ADC.RESULT.getRESULT();
+            processSample(channel, result, gainShifts[channel]);
+            gainShifts[channel] = rangeGain(result, gainShifts[channel]);
 
             channel++;
             if (channel >= SENSOR_CHANNELS) {
                 channel = 0;
+                publishFrame();
             }
 
             startConversion(channel);
+            isrCycles.stop();
         }
 
     }
@@ -108,8 +208,12 @@ public:
         return SENSOR_CHANNELS;
     }
 
-    virtual int getChannel(int channel) {
-        return values[channel];
+    virtual bool readFrame(TouchFrame* frame, unsigned int lastSequence) {
+        return frameBuffer.read(frame, lastSequence);
+    }
+
+    virtual void setFrameEventId(int eventId) {
+        frameEventId = eventId;
     }
 };
 
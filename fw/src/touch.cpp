@@ -1,5 +1,71 @@
+const int TOUCH_FRAME_CHANNELS = 8;
+
+// one complete scan of all sensor channels
+struct TouchFrame {
+    unsigned int sequence;  // incremented by one for every published frame
+    unsigned int timestamp; // timebase::now() when the scan completed
+    int channels[TOUCH_FRAME_CHANNELS];
+};
+
+/*
+ * TouchFrameBuffer - lock-free single producer, single consumer frame ring
+ *
+ * The producer (sensor ISR) fills the slot after the last published one and
+ * then publishes it by bumping `published`. The consumer copies the latest
+ * published slot. The ISR can't be preempted by the consumer, so if it
+ * recycled the slot during the copy, the slot's sequence has changed by the
+ * time the copy is done and the consumer just takes the newer frame.
+ */
+class TouchFrameBuffer {
+    static const int SLOTS = 4;
+    TouchFrame slots[SLOTS];
+    volatile unsigned int published = 0;
+
+public:
+
+    // producer: slot to fill with the next frame
+    TouchFrame* next() {
+        return &slots[(published + 1) % SLOTS];
+    }
+
+    // producer: makes the frame returned by next() visible to the consumer
+    void publish(unsigned int timestamp) {
+        unsigned int sequence = published + 1;
+        TouchFrame* frame = &slots[sequence % SLOTS];
+        frame->timestamp = timestamp;
+        frame->sequence = sequence;
+        asm volatile("" ::: "memory");
+        published = sequence;
+    }
+
+    // consumer: copies the latest frame, returns false if there is none newer than lastSequence
+    bool read(TouchFrame* frame, unsigned int lastSequence) {
+        for (;;) {
+            unsigned int sequence = published;
+            if (sequence == lastSequence) {
+                return false;
+            }
+            asm volatile("" ::: "memory");
+            TouchFrame* slot = &slots[sequence % SLOTS];
+            *frame = *slot;
+            asm volatile("" ::: "memory");
+            if (slot->sequence == sequence) {
+                return true;
+            }
+        }
+    }
+};
+
 class TouchSensor {
 public:
+    // the sensor interrupt, a sample or a frame depending on TOUCH_SCAN_DMA
+    clocks::CycleMeter isrCycles;
+
     virtual int getChannelCount() = 0;
-    virtual int getChannel(int channel) = 0;
-};
\ No newline at end of file
+    // copies the latest complete frame, returns false if its sequence is still lastSequence;
+    // channel values are samples scaled to 24 bits whatever the ADC resolution,
+    // the low bits below the sample are filter fraction
+    virtual bool readFrame(TouchFrame* frame, unsigned int lastSequence) = 0;
+    // schedules the application event each time a frame is published
+    virtual void setFrameEventId(int eventId) = 0;
+};
@@ -1,40 +1,159 @@
 const int CFG_REQUEST_GET_STATUS = 0x01; // IN,  data: bytes [patch version high byte, patch version low byte]
+const int CFG_REQUEST_GET_CLOCKS = 0x02; // IN,  data: flags (bit 0 measured, bit 1 DFLL locked to USB), big-endian uint32
+                                         //      CPU Hz, timebase Hz, touch frame rate mHz, as measured after boot
+const int CFG_REQUEST_GET_CYCLES = 0x03; // IN,  data: big-endian uint32 CPU cycles of the touch sensor interrupt (min, max)
+                                         //      and of decoding a frame (min, max), 0 before the first
+const int CFG_REQUEST_GET_EVENTS = 0x04; // IN,  data: big-endian uint32 gesture events merged into a pending report,
+                                         //      dropped because the key queue was full, touch frames never decoded, since boot
 
 const int CFG_REQUEST_SET_PARAMETER = 0x10; // OUT, wValue low byte: parameter key, wValue high byte: parameter value
+                                            //      key high nibble: 0 selected profile, or profile + 1
 const int CFG_REQUEST_GET_PARAMETER = 0x11; // IN,  wValue low byte: parameter key, data: parameter value (one byte)
 const int CFG_REQUEST_SET_DEFAULTS = 0x12; // IN, data: none
+const int CFG_REQUEST_GET_WEAR = 0x13; // IN,  data: big-endian uint32 config row erases, records in the row (one byte)
+const int CFG_REQUEST_TRY_PARAMETER = 0x14; // OUT, as CFG_REQUEST_SET_PARAMETER, but not saved until CFG_REQUEST_COMMIT
+const int CFG_REQUEST_COMMIT = 0x15; // OUT, saves changes not saved yet now, data: none
+const int CFG_REQUEST_GET_CONFIG = 0x16; // IN,  data: configuration block, version byte and all parameters (DeviceConfiguration::getBlock)
+const int CFG_REQUEST_SET_CONFIG = 0x17; // OUT, data: configuration block, applied and saved at once; stall if its version differs
+const int CFG_REQUEST_SELECT_PROFILE = 0x18; // OUT, wValue: profile, applied at once and not saved; stall if there's no such profile
+const int CFG_REQUEST_GET_PROFILES = 0x19; // IN,  data: selected profile, names of all profiles, CONFIG_PROFILE_NAME_SIZE bytes each, zero padded
+const int CFG_REQUEST_SET_PROFILE_NAME = 0x1A; // OUT, wValue: profile, data: none or name of up to CONFIG_PROFILE_NAME_SIZE bytes
 
-const int CFG_REQUEST_IMG_PREPARE = 0x20; // OUT, wValue: image size in pages
-const int CFG_REQUEST_IMG_INSTALL = 0x21; // OUT, wValue: CRC16
+const int CFG_REQUEST_IMG_PREPARE = 0x20; // OUT, wValue: image size in pages, data: none or image tag as big-endian uint32
+const int CFG_REQUEST_IMG_INSTALL = 0x21; // OUT, data: CRC32 of the image as big-endian uint32
+                                          //      or no data and wValue: XOR CRC16 (tools before firmware 1.1)
+const int CFG_REQUEST_IMG_PREPARE_COMPRESSED = 0x22; // OUT, wValue: decompressed image size in pages, image follows LZ compressed (lz-decoder.cpp),
+                                                    //      data: none or image tag as big-endian uint32
+const int CFG_REQUEST_IMG_STATISTICS = 0x23; // IN,  data: big-endian uint16 rows erased, skipped, retried, failed by the last install; stall if none
+const int CFG_REQUEST_IMG_STATUS = 0x24; // IN,  data: big-endian uint16 image size in pages, big-endian uint32 image tag,
+                                         //      receipt bitmap of FWU_RECEIPT_BYTES, bit per page lowest first, set if present and valid
+const int CFG_REQUEST_IMG_SEEK = 0x25; // OUT, wValue: first page of a row, raw pages sent next go there; stall if not a row start
+
+/*
+ * FwuEndpoint - the upload endpoint, its packets are handled in the main loop
+ *
+ * Bank 0 is armed in one place, arm(). The library re-arms it through
+ * startRx() when rxComplete() returns, at rxBufferPtr; while a packet waits
+ * that is ignored, so the bank stays full and the host gets NAKs until
+ * FirmwareUpdate has taken the packet and drain() arms the bank again.
+ *
+ * Raw pages are received straight into the page buffer of FirmwareUpdate
+ * they are programmed from. With all of them taken the bank is left full
+ * until one is freed. Everything else is received into rxBuffer.
+ */
+class FwuEndpoint : public usbd::UsbEndpoint, public applicationEvents::EventHandler, public PageReceiver {
+  int packetEventId;
+  volatile int rxLength = -1; // of the packet waiting at rxBufferPtr, -1 if none
+  volatile bool rxHeld = false; // not armed, waiting for a page buffer
+
+  // with interrupts masked or from the USB interrupt
+  void arm() {
+    unsigned char* buffer = rxBuffer;
+    if (firmwareUpdate.isReceivingPages()) {
+      buffer = firmwareUpdate.getPageBuffer();
+      if (!buffer) {
+        rxHeld = true;
+        return;
+      }
+    }
+    rxHeld = false;
+    rxBufferPtr = buffer;
+    usbd::UsbEndpoint::startRx();
+  }
 
-class FwuEndpoint : public usbd::UsbEndpoint {
 public:
 
   FirmwareUpdate firmwareUpdate;
 
   int key = 0;
   int count = 0;
-  unsigned char rxBuffer[flash::PAGE_SIZE];
+  unsigned char rxBuffer[flash::PAGE_SIZE] __attribute__((aligned(4)));
 
   void init() {
     rxBufferPtr = rxBuffer;
     rxBufferSize = sizeof(rxBuffer);
     usbd::UsbEndpoint::init();
+    packetEventId = applicationEvents::createEventId();
+    handle(packetEventId);
   }
 
-  void rxComplete(int length) {
-    // We expect length to be always equal to PAGE_SIZE. Last packet must be padded by the host.
-    if (length == flash::PAGE_SIZE) {
-      firmwareUpdate.write(rxBuffer);
+  // the library's re-arm, taken over by arm()
+  void startRx() {
+    if (rxLength < 0) {
+      arm();
     }
+  }
+
+  void rxComplete(int length) {
+    rxLength = length;
+    applicationEvents::schedule(packetEventId);
   };
 
+  void pageBufferFreed() {
+    unsigned int primask = flash::disableInterrupts();
+    if (rxHeld) {
+      arm();
+    }
+    flash::restoreInterrupts(primask);
+  }
+
+  // passes the packet waiting, if any, to firmwareUpdate and takes the next one
+  void drain() {
+    if (rxLength >= 0) {
+      unsigned char* data = rxBufferPtr;
+      if (data != rxBuffer && firmwareUpdate.isCompressed()) {
+        // armed for a raw page before the upload was prepared compressed,
+        // the decoder is about to fill that page buffer
+        memcpy(rxBuffer, data, rxLength);
+        data = rxBuffer;
+      }
+      firmwareUpdate.receive(data, rxLength);
+      // the USB interrupt calls startRx() too
+      unsigned int primask = flash::disableInterrupts();
+      rxLength = -1;
+      arm();
+      flash::restoreInterrupts(primask);
+    }
+  }
+
+  void onEvent() {
+    drain();
+  }
+
 };
 
-class CfgInterface : public usbd::UsbInterface {
+class CfgInterface : public usbd::UsbInterface, public ControlDataHandler, public applicationEvents::EventHandler {
+  // IN replies, streamed by ControlEndpoint after setup() returns
+  // (CFG_REQUEST_GET_PROFILES is shorter than the configuration block)
+  unsigned char reply[6 + FWU_RECEIPT_BYTES > CONFIG_BLOCK_SIZE ? 6 + FWU_RECEIPT_BYTES : CONFIG_BLOCK_SIZE];
+
+  // request waiting for its data stage, and its wValue if needed
+  int dataRequest;
+  int setupPages;
+  int setupProfile;
+
+  // image request that has to wait for the uploaded pages, completed from the main loop;
+  // the host gets NAKs in its status or data stage meanwhile
+  int deferredEventId;
+  int deferredRequest;
+  unsigned int deferredValue;
+  int deferredLength; // of the data stage received, or wLength of an IN request
+
+  void defer(int request, unsigned int value, int length) {
+    deferredRequest = request;
+    deferredValue = value;
+    deferredLength = length;
+    applicationEvents::schedule(deferredEventId);
+  }
+
 public:
   FwuEndpoint fwuEndpoint;
   DeviceConfiguration deviceConfiguration;
+  ClockMeasurement clockMeasurement;
+  // reported by CFG_REQUEST_GET_CYCLES and CFG_REQUEST_GET_EVENTS, set by the application
+  TouchSensor* touchSensor = NULL;
+  GestureDecoder* gestureDecoder = NULL;
+  HidEndpoint* hidEndpoint = NULL;
 
   virtual UsbEndpoint* getEndpoint(int index) { return index == 0 ? &fwuEndpoint : NULL; }
 
@@ -43,31 +162,241 @@ public:
   void init() {
     UsbInterface::init();
     deviceConfiguration.init();
+    fwuEndpoint.firmwareUpdate.init(&fwuEndpoint);
+    deferredEventId = applicationEvents::createEventId();
+    handle(deferredEventId);
   }
 
-  void setup(SetupData* setup) {
+  void onEvent() {
+    ControlEndpoint* endpoint = (ControlEndpoint*)device->getControlEndpoint();
+    FirmwareUpdate* firmwareUpdate = &fwuEndpoint.firmwareUpdate;
+
+    // everything sent before the request goes first
+    fwuEndpoint.drain();
+    firmwareUpdate->flush();
+
+    switch (deferredRequest) {
+
+    case CFG_REQUEST_IMG_PREPARE:
+    case CFG_REQUEST_IMG_PREPARE_COMPRESSED: {
+      firmwareUpdate->prepare(setupPages, deferredRequest == CFG_REQUEST_IMG_PREPARE_COMPRESSED, deferredValue);
+      endpoint->startTx(0);
+      break;
+    }
+
+    case CFG_REQUEST_IMG_INSTALL: {
+      bool valid = deferredLength == 4 ? firmwareUpdate->checkCrc32(deferredValue) : firmwareUpdate->checkCrc(deferredValue);
+      if (firmwareUpdate->isComplete() && valid) {
+        endpoint->startTx(0);
+        firmwareUpdate->install();
+      } else {
+        endpoint->stall();
+      }
+      break;
+    }
+
+    case CFG_REQUEST_IMG_STATUS: {
+      int pages = firmwareUpdate->getPagesExpected();
+      unsigned int tag = firmwareUpdate->getTag();
+      reply[0] = pages >> 8;
+      reply[1] = pages & 0xff;
+      reply[2] = tag >> 24;
+      reply[3] = tag >> 16;
+      reply[4] = tag >> 8;
+      reply[5] = tag & 0xff;
+      const unsigned char* receipts = firmwareUpdate->getReceipts();
+      for (int i = 0; i < FWU_RECEIPT_BYTES; i++) {
+        reply[6 + i] = receipts[i];
+      }
+      endpoint->sendData(reply, 6 + FWU_RECEIPT_BYTES, deferredLength);
+      break;
+    }
+
+    case CFG_REQUEST_IMG_SEEK: {
+      if (firmwareUpdate->seek(deferredValue)) {
+        endpoint->startTx(0);
+      } else {
+        endpoint->stall();
+      }
+      break;
+    }
+
+    }
+  }
+
+  void controlDataReceived(unsigned char* data, int length) {
     usbd::UsbEndpoint* endpoint = device->getControlEndpoint();
+
+    if (dataRequest == CFG_REQUEST_SET_CONFIG || dataRequest == CFG_REQUEST_SET_PROFILE_NAME) {
+      bool accepted = dataRequest == CFG_REQUEST_SET_CONFIG ?
+        deviceConfiguration.setBlock(data, length) :
+        deviceConfiguration.setProfileName(setupProfile, data, length);
+      if (accepted) {
+        endpoint->startTx(0);
+      } else {
+        endpoint->stall();
+      }
+      return;
+    }
+
+    if (length != 4) {
+      endpoint->stall();
+      return;
+    }
+    unsigned int value = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+
+    switch (dataRequest) {
+
+    case CFG_REQUEST_IMG_PREPARE:
+    case CFG_REQUEST_IMG_PREPARE_COMPRESSED:
+    case CFG_REQUEST_IMG_INSTALL: {
+      defer(dataRequest, value, length);
+      break;
+    }
+
+    default:
+      endpoint->stall();
+    }
+  }
+
+  void setup(SetupData* setup) {
+    // the device registers a ControlEndpoint, see main.cpp
+    ControlEndpoint* endpoint = (ControlEndpoint*)device->getControlEndpoint();
     switch (setup->bRequest) {
 
     case CFG_REQUEST_GET_STATUS: {
-      endpoint->txBufferPtr[0] = project::versionInt[2] >> 8;
-      endpoint->txBufferPtr[1] = project::versionInt[2] & 0xff;
-      endpoint->startTx(2);
+      reply[0] = project::versionInt[2] >> 8;
+      reply[1] = project::versionInt[2] & 0xff;
+      endpoint->sendData(reply, 2, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_GET_CLOCKS: {
+      reply[0] = (clockMeasurement.isMeasured() ? 1 : 0) | (clocks::isLocked() ? 2 : 0);
+      int values[] = { clockMeasurement.getCpuHz(), clockMeasurement.getTimebaseHz(), clockMeasurement.getTouchFrameMilliHz() };
+      for (int i = 0; i < 3; i++) {
+        reply[1 + i * 4] = values[i] >> 24;
+        reply[2 + i * 4] = values[i] >> 16;
+        reply[3 + i * 4] = values[i] >> 8;
+        reply[4 + i * 4] = values[i] & 0xff;
+      }
+      endpoint->sendData(reply, 13, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_GET_CYCLES: {
+      if (!touchSensor || !gestureDecoder) {
+        endpoint->stall();
+        break;
+      }
+      const clocks::CycleMeter* meters[] = { &touchSensor->isrCycles, &gestureDecoder->decodeCycles };
+      for (int i = 0; i < 2; i++) {
+        unsigned int values[] = { meters[i]->max ? meters[i]->min : 0, meters[i]->max };
+        for (int j = 0; j < 2; j++) {
+          unsigned char* value = &reply[i * 8 + j * 4];
+          value[0] = values[j] >> 24;
+          value[1] = values[j] >> 16;
+          value[2] = values[j] >> 8;
+          value[3] = values[j] & 0xff;
+        }
+      }
+      endpoint->sendData(reply, 16, setup->wLength);
       break;
     }
 
-    case CFG_REQUEST_SET_PARAMETER: {
+    case CFG_REQUEST_GET_EVENTS: {
+      if (!hidEndpoint || !gestureDecoder) {
+        endpoint->stall();
+        break;
+      }
+      unsigned int values[] = { hidEndpoint->eventsCoalesced, hidEndpoint->eventsDropped, gestureDecoder->framesMissed };
+      for (int i = 0; i < 3; i++) {
+        reply[i * 4] = values[i] >> 24;
+        reply[i * 4 + 1] = values[i] >> 16;
+        reply[i * 4 + 2] = values[i] >> 8;
+        reply[i * 4 + 3] = values[i] & 0xff;
+      }
+      endpoint->sendData(reply, 12, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_SET_PARAMETER:
+    case CFG_REQUEST_TRY_PARAMETER: {
       unsigned char key = setup->wValue & 0xff;
       unsigned char value = setup->wValue >> 8;
-      deviceConfiguration.setParameter(key, value);
+      deviceConfiguration.setParameter(key, value, setup->bRequest == CFG_REQUEST_SET_PARAMETER);
+      endpoint->startTx(0);
+      break;
+    }
+
+    case CFG_REQUEST_COMMIT: {
+      deviceConfiguration.commit();
       endpoint->startTx(0);
       break;
     }
 
+    case CFG_REQUEST_GET_CONFIG: {
+      int length = deviceConfiguration.getBlock(reply);
+      endpoint->sendData(reply, length, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_SET_CONFIG: {
+      // the block comes in a single packet of the data stage
+      if (setup->wLength == 0 || setup->wLength > CONTROL_PACKET_SIZE) {
+        endpoint->stall();
+        break;
+      }
+      dataRequest = setup->bRequest;
+      endpoint->receiveData(this);
+      break;
+    }
+
+    case CFG_REQUEST_SELECT_PROFILE: {
+      if (deviceConfiguration.selectProfile(setup->wValue)) {
+        endpoint->startTx(0);
+      } else {
+        endpoint->stall();
+      }
+      break;
+    }
+
+    case CFG_REQUEST_GET_PROFILES: {
+      reply[0] = deviceConfiguration.getProfile();
+      for (int profile = 0; profile < CONFIG_PROFILES; profile++) {
+        const char* name = deviceConfiguration.getProfileName(profile);
+        for (int i = 0; i < CONFIG_PROFILE_NAME_SIZE; i++) {
+          reply[1 + profile * CONFIG_PROFILE_NAME_SIZE + i] = name[i];
+        }
+      }
+      endpoint->sendData(reply, 1 + CONFIG_PROFILES * CONFIG_PROFILE_NAME_SIZE, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_SET_PROFILE_NAME: {
+      if (setup->wLength > CONFIG_PROFILE_NAME_SIZE) {
+        endpoint->stall();
+        break;
+      }
+      if (setup->wLength > 0) {
+        // name follows in the data stage
+        dataRequest = setup->bRequest;
+        setupProfile = setup->wValue;
+        endpoint->receiveData(this);
+        break;
+      }
+      if (deviceConfiguration.setProfileName(setup->wValue, NULL, 0)) {
+        endpoint->startTx(0);
+      } else {
+        endpoint->stall();
+      }
+      break;
+    }
+
     case CFG_REQUEST_GET_PARAMETER: {
       unsigned char key = setup->wValue & 0xff;
-      endpoint->txBufferPtr[0] = deviceConfiguration.getParameter(key);
-      endpoint->startTx(1);
+      reply[0] = deviceConfiguration.getParameter(key);
+      endpoint->sendData(reply, 1, setup->wLength);
       break;
     }
 
@@ -77,23 +406,68 @@ public:
       break;
     }
 
-    case CFG_REQUEST_IMG_PREPARE: {
-      fwuEndpoint.firmwareUpdate.prepare(setup->wValue);
-      endpoint->startTx(0);
+    case CFG_REQUEST_GET_WEAR: {
+      unsigned int erases = deviceConfiguration.getErases();
+      reply[0] = erases >> 24;
+      reply[1] = erases >> 16;
+      reply[2] = erases >> 8;
+      reply[3] = erases & 0xff;
+      reply[4] = deviceConfiguration.getRecords();
+      endpoint->sendData(reply, 5, setup->wLength);
       break;
     }
 
-    case CFG_REQUEST_IMG_INSTALL: {
-      unsigned int crc16 = setup->wValue;
-      if (fwuEndpoint.firmwareUpdate.checkCrc(crc16)) {
-        endpoint->startTx(0);
-        fwuEndpoint.firmwareUpdate.install();
+    case CFG_REQUEST_IMG_PREPARE:
+    case CFG_REQUEST_IMG_PREPARE_COMPRESSED: {
+      if (setup->wLength == 4) {
+        // image tag follows in the data stage
+        dataRequest = setup->bRequest;
+        setupPages = setup->wValue;
+        endpoint->receiveData(this);
+        break;
+      }
+      setupPages = setup->wValue;
+      defer(setup->bRequest, 0, 0);
+      break;
+    }
+
+    case CFG_REQUEST_IMG_STATUS: {
+      defer(setup->bRequest, 0, setup->wLength);
+      break;
+    }
+
+    case CFG_REQUEST_IMG_SEEK: {
+      defer(setup->bRequest, setup->wValue, 0);
+      break;
+    }
+
+    case CFG_REQUEST_IMG_STATISTICS: {
+      const flash::InstallStatistics* statistics = fwuEndpoint.firmwareUpdate.getInstallStatistics();
+      if (statistics) {
+        unsigned short values[] = { statistics->rowsErased, statistics->rowsSkipped, statistics->rowsRetried, statistics->rowsFailed };
+        for (int i = 0; i < 4; i++) {
+          reply[i * 2] = values[i] >> 8;
+          reply[i * 2 + 1] = values[i] & 0xff;
+        }
+        endpoint->sendData(reply, 8, setup->wLength);
       } else {
         endpoint->stall();
       }
       break;
     }
 
+    case CFG_REQUEST_IMG_INSTALL: {
+      if (setup->wLength == 4) {
+        // CRC32 follows in the data stage
+        dataRequest = setup->bRequest;
+        endpoint->receiveData(this);
+        break;
+      }
+      // XOR CRC16 in wValue
+      defer(setup->bRequest, setup->wValue, 0);
+      break;
+    }
+
     default:
       endpoint->stall();
     }
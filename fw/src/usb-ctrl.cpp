@@ -0,0 +1,90 @@
+#include <string.h>
+
+// bMaxPacketSize0 of the device descriptor
+const int CONTROL_PACKET_SIZE = 64;
+
+/*
+ * ControlDataHandler - receives the data stage of a host to device control request
+ *
+ * The handler completes the status stage, as setup() does for requests
+ * without data: startTx(0) to accept, stall() to refuse.
+ */
+class ControlDataHandler {
+public:
+  virtual void controlDataReceived(unsigned char* data, int length) = 0;
+};
+
+/*
+ * ControlEndpoint - UsbControlEndpoint with streamed IN and OUT data stages
+ *
+ * Short replies are still built in txBufferPtr and sent with startTx. Longer
+ * ones, like descriptors in flash, go through sendData(): the reply is cut
+ * to wLength and sent one packet at a time as the host collects them, each
+ * packet copied from the source straight into the packet buffer (the USB
+ * DMA reads RAM only), so no reply has to fit the buffer as a whole. A reply
+ * shorter than wLength ending on a packet boundary is closed with a zero
+ * length packet.
+ *
+ * A request with an OUT data stage (e.g. HID SET_REPORT) calls receiveData()
+ * from setup(); the next packet received is passed to the handler, which
+ * completes the status stage.
+ *
+ * Everything else goes to the library as before.
+ */
+class ControlEndpoint : public usbd::UsbControlEndpoint {
+  ControlDataHandler* dataHandler = NULL;
+
+  const unsigned char* txData = NULL; // rest of the reply being streamed
+  int txRemaining = 0;
+  bool txTerminate = false;           // reply is shorter than wLength
+  bool streaming = false;             // more packets of the reply to go
+
+  void sendPacket() {
+    int length = txRemaining < CONTROL_PACKET_SIZE ? txRemaining : CONTROL_PACKET_SIZE;
+    memcpy(txBufferPtr, txData, length);
+    txData += length;
+    txRemaining -= length;
+    // a full packet leaves the host waiting for more, unless it got all of wLength;
+    // a short (or zero length) one ends the data stage
+    streaming = length == CONTROL_PACKET_SIZE && (txRemaining > 0 || txTerminate);
+    startTx(length);
+  }
+
+public:
+
+  // IN data stage of any length, data must stay valid until the transfer ends
+  void sendData(const void* data, int length, int requested) {
+    if (length > requested) {
+      length = requested;
+    }
+    txData = (const unsigned char*)data;
+    txRemaining = length;
+    txTerminate = length < requested;
+    sendPacket();
+  }
+
+  void receiveData(ControlDataHandler* handler) {
+    dataHandler = handler;
+  }
+
+  void txComplete() {
+    if (streaming) {
+      sendPacket();
+    }
+    else {
+      usbd::UsbControlEndpoint::txComplete();
+    }
+  }
+
+  void rxComplete(int length) {
+    if (dataHandler) {
+      ControlDataHandler* handler = dataHandler;
+      dataHandler = NULL;
+      handler->controlDataReceived(rxBufferPtr, length);
+    }
+    else {
+      usbd::UsbControlEndpoint::rxComplete(length);
+    }
+  }
+
+};
@@ -1,9 +1,12 @@
-#include <string.h>
-
 #define HID_GET_DESCRIPTOR 0x06
 #define HID_DESCRIPTOR_TYPE_HID 0x21
 #define HID_DESCRIPTOR_TYPE_REPORT 0x22
 
+#define HID_REQUEST_TYPE_CLASS 0x20
+#define HID_GET_REPORT 0x01
+#define HID_SET_REPORT 0x09
+#define HID_REPORT_TYPE_FEATURE 0x03
+
 struct __attribute__((packed)) HidDescriptor {
   unsigned char bLength;
   unsigned char bDescriptorType;
@@ -17,7 +20,7 @@ struct __attribute__((packed)) HidDescriptor {
 /*
  * HID Report Descriptor for SoundSlide
  *
- * Report Structure (4 bytes total):
+ * Report Structure (5 bytes total):
  *   Byte 0: Consumer Control keys (bit flags)
  *           - Bit 0: Volume Up
  *           - Bit 1: Volume Down
@@ -25,14 +28,21 @@ struct __attribute__((packed)) HidDescriptor {
  *           - Bit 3: Brightness Down
  *           - Bit 4: Microphone Mute (single tap triggers this)
  *           - Bits 5-7: Padding
- *   Byte 1: Mouse scroll wheel (-127 to 127)
- *   Byte 2: Keyboard modifiers (bit flags)
+ *   Byte 1: Consumer Volume, relative linear control (-127 to 127)
+ *           - used instead of Volume Up/Down when volume mode is linear
+ *   Byte 2: Mouse scroll wheel (-127 to 127)
+ *           - in 1/8 detents if the host set the Resolution Multiplier
+ *   Byte 3: Keyboard modifiers (bit flags)
  *           - Bit 0: Left Ctrl
  *           - Bit 1: Left Shift
  *           - Bit 2: Left Alt
  *           - Bit 3: Left GUI (Windows key) - used for Win+L lock
  *           - Bits 4-7: Right modifiers (not used)
- *   Byte 3: Keyboard key code (e.g., 0x0F = 'L' for lock workstation)
+ *   Byte 4: Keyboard key code (e.g., 0x0F = 'L' for lock workstation)
+ *
+ * Feature report (1 byte): Resolution Multiplier of the wheel
+ *   0 - whole detents (default, hosts without high-resolution scrolling)
+ *   1 - 8 steps per detent
  *
  * Tap Actions:
  *   - Single tap: Sends Microphone Mute (Consumer Control)
@@ -56,6 +66,12 @@ const unsigned char hidReportDescriptor[] = {
   0x81, 0x02,        //   Input (Data, Variable, Absolute)
   0x95, 0x03,        //   Report Count (3) - Padding bits to make a byte
   0x81, 0x03,        //   Input (Constant, Variable, Absolute)
+  0x09, 0xE0,        //   Usage (Volume) - whole slide delta in one report
+  0x15, 0x81,        //   Logical Minimum (-127)
+  0x25, 0x7F,        //   Logical Maximum (127)
+  0x75, 0x08,        //   Report Size (8)
+  0x95, 0x01,        //   Report Count (1)
+  0x81, 0x06,        //   Input (Data, Variable, Relative)
   0xC0,              // End Collection
 
   // Mouse Scroll
@@ -64,12 +80,24 @@ const unsigned char hidReportDescriptor[] = {
   0xA1, 0x01,        // Collection (Application)
   0x09, 0x01,        //   Usage (Pointer)
   0xA1, 0x00,        //   Collection (Physical)
-  0x09, 0x38,        //     Usage (Wheel)
-  0x15, 0x81,        //     Logical Min (-127)
-  0x25, 0x7F,        //     Logical Max (127)
-  0x75, 0x08,        //     Report Size (8)
-  0x95, 0x01,        //     Report Count (1)
-  0x81, 0x06,        //     Input (Data, Var, Rel)
+  0xA1, 0x02,        //     Collection (Logical) - multiplier applies to the wheel in it
+  0x09, 0x48,        //       Usage (Resolution Multiplier)
+  0x15, 0x00,        //       Logical Min (0) - detents
+  0x25, 0x01,        //       Logical Max (1) - fine steps
+  0x35, 0x01,        //       Physical Min (1)
+  0x45, 0x08,        //       Physical Max (8) - 1 << SCROLL_RESOLUTION_SHIFT
+  0x75, 0x08,        //       Report Size (8)
+  0x95, 0x01,        //       Report Count (1)
+  0xB1, 0x02,        //       Feature (Data, Var, Abs)
+  0x35, 0x00,        //       Physical Min (0)
+  0x45, 0x00,        //       Physical Max (0)
+  0x09, 0x38,        //       Usage (Wheel)
+  0x15, 0x81,        //       Logical Min (-127)
+  0x25, 0x7F,        //       Logical Max (127)
+  0x75, 0x08,        //       Report Size (8)
+  0x95, 0x01,        //       Report Count (1)
+  0x81, 0x06,        //       Input (Data, Var, Rel)
+  0xC0,              //     End Collection
   0xC0,              //   End Collection
   0xC0,              // End Collection
 
@@ -99,34 +127,146 @@ const unsigned char hidReportDescriptor[] = {
 
 };
 
-// Keyboard modifier bit flags (byte 2 of report)
+// Byte offsets in the report
+const int REPORT_CONSUMER_KEYS = 0;
+const int REPORT_VOLUME = 1;
+const int REPORT_SCROLL = 2;
+const int REPORT_MODIFIERS = 3;
+const int REPORT_KEY_CODE = 4;
+const int REPORT_SIZE = 5;
+
+// wheel steps per detent once the host sets the Resolution Multiplier: 1 << 3
+const int SCROLL_RESOLUTION_SHIFT = 3;
+
+// Keyboard modifier bit flags (REPORT_MODIFIERS byte)
 const unsigned char MODIFIER_LEFT_GUI = 0x08;  // Windows/Command key
 
-// Keyboard key codes (byte 3 of report)
+// Keyboard key codes (REPORT_KEY_CODE byte)
 const unsigned char KEY_CODE_L = 0x0F;  // 'L' key for lock workstation
 
+/*
+ * Relative report field fed by the producer and drained by the consumer.
+ * Each side writes only its own running total, so no locking is needed.
+ */
+struct RelativeAccumulator {
+  volatile int produced = 0;
+  volatile int consumed = 0;
+
+  // adds steps, returns true if they were merged with steps not yet reported
+  bool add(int steps) {
+    bool pending = produced != consumed;
+    produced += steps;
+    return pending;
+  }
+
+  // steps not yet reported, limited to a report byte
+  int peek() {
+    int steps = produced - consumed;
+    if (steps > 127) {
+      steps = 127;
+    }
+    if (steps < -127) {
+      steps = -127;
+    }
+    return steps;
+  }
+
+  void take(int steps) {
+    consumed += steps;
+  }
+
+  // drops the steps not yet reported, consumer side
+  void clear() {
+    consumed = produced;
+  }
+};
+
 /*
  * HidEndpoint handles sending HID reports to the host.
  *
- * Report format (4 bytes):
+ * Report format (5 bytes):
  *   [0] Consumer keys (Volume Up/Down, Brightness Up/Down, Mic Mute)
- *   [1] Scroll wheel
- *   [2] Keyboard modifiers (Left GUI for Win key)
- *   [3] Keyboard key code ('L' for lock)
+ *   [1] Volume delta
+ *   [2] Scroll wheel
+ *   [3] Keyboard modifiers (Left GUI for Win key)
+ *   [4] Keyboard key code ('L' for lock)
  *
  * Usage:
  *   - reportKey(KEY_VOLUME_UP/DOWN, count): Volume control
  *   - reportKey(KEY_BRIGHTNESS_UP/DOWN, count): Brightness control
  *   - reportKey(KEY_MIC_MUTE, 1): Microphone mute (single tap)
  *   - reportKey(KEY_LOCK_WORKSTATION, 1): Win+L lock (double tap)
- *   - reportScroll(steps): Mouse wheel scrolling
+ *   - reportScroll(steps): Mouse wheel scrolling, in 1 << getScrollResolutionShift() steps per detent
+ *   - reportVolume(steps): Volume change as one relative report
+ *
+ * Gesture events are decoupled from USB transfers:
+ *   - key events go to a fixed-capacity single producer, single consumer
+ *     queue; the consumer (USB completion) expands each into key down/up
+ *     report pairs, so a chain is never cut short by a later event
+ *   - a key event for the same key as the last queued one is merged into
+ *     it; the producer only raises `produced`, the consumer only raises
+ *     `consumed`, and the last entry is never retired, so this is lock-free
+ *   - scroll and volume steps are added to running totals; every report
+ *     carries all steps added since the previous one, so steps during a key
+ *     chain or between host polls are merged, not lost
+ *   - a report goes out only if it is dirty, so an idle device sends nothing
+ *
+ * The producer (gesture decoder) never preempts the USB interrupt, so the
+ * consumer sees the queue and `busy` consistently; the producer only starts
+ * a transfer itself when none is in flight, with interrupts masked, as a
+ * bus reset clears `busy` from the USB interrupt (reset()).
  */
 class HidEndpoint : public usbd::UsbEndpoint {
+
+  struct KeyEvent {
+    unsigned char key;
+    unsigned short produced; // presses requested, written by producer
+    unsigned short consumed; // presses sent, written by consumer
+  };
+
+  static const int KEY_QUEUE_SIZE = 8;
+  KeyEvent keyQueue[KEY_QUEUE_SIZE];
+  volatile unsigned int keyQueueHead = 0; // written by consumer
+  volatile unsigned int keyQueueTail = 0; // written by producer
+  bool releasePending = false;            // key at head is down, consumer state
+
+  RelativeAccumulator scroll;
+  RelativeAccumulator volume;
+
+  // 0 - detents, SCROLL_RESOLUTION_SHIFT - the host set the Resolution Multiplier
+  volatile int scrollResolutionShift = 0;
+
+  volatile bool busy = false;
+
+  // last report sent, the host holds its absolute fields until told otherwise
+  unsigned char lastReport[REPORT_SIZE];
+
+  // a report is worth sending if it carries relative movement (volume, scroll)
+  // or changes any absolute field (keys, modifiers)
+  bool isDirty(unsigned char* report) {
+    return
+      report[REPORT_VOLUME] != 0 ||
+      report[REPORT_SCROLL] != 0 ||
+      report[REPORT_CONSUMER_KEYS] != lastReport[REPORT_CONSUMER_KEYS] ||
+      report[REPORT_MODIFIERS] != lastReport[REPORT_MODIFIERS] ||
+      report[REPORT_KEY_CODE] != lastReport[REPORT_KEY_CODE];
+  }
+
+  void startReport() {
+    unsigned int primask = flash::disableInterrupts();
+    if (!busy) {
+      busy = true;
+      sendReport();
+    }
+    flash::restoreInterrupts(primask);
+  }
+
 public:
-  int key = 0;
-  int count = 0;
-  int scroll = 0;
-  unsigned char txBuffer[4];  // Expanded to 4 bytes for keyboard support
+  unsigned char txBuffer[REPORT_SIZE];
+
+  // events merged into an already pending one / lost because the queue was full
+  unsigned int eventsCoalesced = 0;
+  unsigned int eventsDropped = 0;
 
   void init() {
     txBufferPtr = txBuffer;
@@ -134,63 +274,157 @@ public:
     usbd::UsbEndpoint::init();
   }
 
+  // a bus reset drops the transfer in flight, its txComplete() never comes;
+  // from the USB interrupt, what was not reported yet is dropped too
+  void reset() {
+    // the consumer owns the head, an empty queue is head == tail
+    keyQueueHead = keyQueueTail;
+    releasePending = false;
+    scroll.clear();
+    volume.clear();
+    for (int i = 0; i < REPORT_SIZE; i++) {
+      lastReport[i] = 0;
+    }
+    busy = false;
+  }
+
   void reportKey(int key, int count) {
     if (count) {
-      this->key = key;
-      this->count = count * 2; // one for key down and one for key up
-      sendReport();
+      if (keyQueueTail != keyQueueHead) {
+        KeyEvent* last = &keyQueue[(keyQueueTail - 1) % KEY_QUEUE_SIZE];
+        if (last->key == key) {
+          last->produced += count;
+          eventsCoalesced++;
+          startReport();
+          return;
+        }
+      }
+      if (keyQueueTail - keyQueueHead >= KEY_QUEUE_SIZE) {
+        eventsDropped++;
+        return;
+      }
+      KeyEvent* event = &keyQueue[keyQueueTail % KEY_QUEUE_SIZE];
+      event->key = key;
+      event->consumed = 0;
+      event->produced = count;
+      asm volatile("" ::: "memory");
+      keyQueueTail++;
+      startReport();
     }
   }
 
   void reportScroll(int steps) {
-    this->key = 0;
-    this->count = 0;
-    this->scroll = steps;
-    sendReport();
+    if (steps) {
+      if (scroll.add(steps)) {
+        eventsCoalesced++;
+      }
+      startReport();
+    }
+  }
+
+  int getScrollResolutionShift() {
+    return scrollResolutionShift;
+  }
+
+  void setScrollResolution(bool fine) {
+    scrollResolutionShift = fine ? SCROLL_RESOLUTION_SHIFT : 0;
+  }
+
+  void reportVolume(int steps) {
+    if (steps) {
+      if (volume.add(steps)) {
+        eventsCoalesced++;
+      }
+      startReport();
+    }
   }
 
+  // builds and sends the next report, or goes idle if there is nothing to send
   void sendReport() {
-    // Clear the buffer
-    txBuffer[0] = 0;  // Consumer keys
-    txBuffer[1] = 0;  // Scroll
-    txBuffer[2] = 0;  // Keyboard modifiers
-    txBuffer[3] = 0;  // Keyboard key code
 
-    if (count > 0) {
-      bool keyDown = !(count & 1);  // Even count = key down, odd = key up
+    // retire finished entries, except the last one the producer may still merge into
+    while (
+      !releasePending &&
+      keyQueueHead + 1 != keyQueueTail && keyQueueHead != keyQueueTail &&
+      keyQueue[keyQueueHead % KEY_QUEUE_SIZE].consumed == keyQueue[keyQueueHead % KEY_QUEUE_SIZE].produced
+      ) {
+      keyQueueHead++;
+    }
 
+    int key = -1;
+    bool keyDown = false;
+    if (keyQueueHead != keyQueueTail) {
+      KeyEvent* event = &keyQueue[keyQueueHead % KEY_QUEUE_SIZE];
+      if (releasePending) {
+        key = event->key;
+        event->consumed++;
+        releasePending = false;
+      }
+      else if (event->consumed != event->produced) {
+        key = event->key;
+        keyDown = true;
+        releasePending = true;
+      }
+    }
+
+    int scrollSteps = scroll.peek();
+    int volumeSteps = volume.peek();
+
+    unsigned char report[REPORT_SIZE];
+
+    // Clear the report
+    for (int i = 0; i < REPORT_SIZE; i++) {
+      report[i] = 0;
+    }
+
+    if (keyDown) {
       if (key == KEY_LOCK_WORKSTATION) {
         // Keyboard report for Win+L (lock workstation)
         // Double tap triggers this action
-        if (keyDown) {
-          txBuffer[2] = MODIFIER_LEFT_GUI;  // Windows key modifier
-          txBuffer[3] = KEY_CODE_L;         // 'L' key
-        }
-        // else: key up, all zeros (release all keys)
+        report[REPORT_MODIFIERS] = MODIFIER_LEFT_GUI;  // Windows key modifier
+        report[REPORT_KEY_CODE] = KEY_CODE_L;          // 'L' key
       } else {
         // Consumer control keys (Volume, Brightness, Mic Mute)
-        if (keyDown) {
-          txBuffer[0] = (1 << key);
-        }
+        report[REPORT_CONSUMER_KEYS] = (1 << key);
       }
-      count--;
     }
+    // else: key up, all zeros (release all keys)
 
-    txBuffer[1] = scroll;
-    scroll = 0;
+    report[REPORT_VOLUME] = volumeSteps;
+    report[REPORT_SCROLL] = scrollSteps;
+
+    if (!isDirty(report)) {
+      busy = false;
+      return;
+    }
+
+    for (int i = 0; i < REPORT_SIZE; i++) {
+      txBuffer[i] = report[i];
+      lastReport[i] = report[i];
+    }
+    volume.take(volumeSteps);
+    scroll.take(scrollSteps);
 
     startTx(sizeof(txBuffer));
   }
 
   void txComplete() {
-    if (count) {
-      sendReport();
-    }
+    sendReport();
   }
 
 };
 
-class HidInterface : public usbd::UsbInterface {
+/*
+ * HidInterface - descriptors and class requests of the HID interface
+ *
+ * The only feature report is the wheel Resolution Multiplier. A host that
+ * supports high-resolution scrolling reads the report descriptor and then
+ * sets the multiplier with SET_REPORT; one that doesn't never touches it, so
+ * reading the report descriptor falls back to whole detents.
+ */
+class HidInterface : public usbd::UsbInterface, public ControlDataHandler {
+  unsigned char featureReport[1];
+
 public:
   HidEndpoint hidEndpoint;
 
@@ -217,15 +451,46 @@ public:
     hidDescriptor->wDescriptorLength = sizeof(hidReportDescriptor);
   }
 
-  void setup(SetupData* setup) {
+  // SET_REPORT data stage, the Resolution Multiplier feature report
+  void controlDataReceived(unsigned char* data, int length) {
     usbd::UsbEndpoint* endpoint = device->getControlEndpoint();
+    if (length >= 1) {
+      hidEndpoint.setScrollResolution(data[0] != 0);
+      endpoint->startTx(0);
+    }
+    else {
+      endpoint->stall();
+    }
+  }
+
+  void setup(SetupData* setup) {
+    // the device registers a ControlEndpoint, see main.cpp
+    ControlEndpoint* endpoint = (ControlEndpoint*)device->getControlEndpoint();
+    bool classRequest = (setup->bmRequestType & 0x60) == HID_REQUEST_TYPE_CLASS;
     if (
+      !classRequest &&
       setup->bRequest == HID_GET_DESCRIPTOR &&
       setup->wValue == (HID_DESCRIPTOR_TYPE_REPORT << 8) | 0 &&
       setup->wIndex == 0
       ) {
-      memcpy(endpoint->txBufferPtr, hidReportDescriptor, sizeof(hidReportDescriptor));
-      endpoint->startTx(sizeof(hidReportDescriptor));
+      // a host parsing the descriptor starts with the multiplier at its default
+      hidEndpoint.setScrollResolution(false);
+      endpoint->sendData(hidReportDescriptor, sizeof(hidReportDescriptor), setup->wLength);
+    }
+    else if (
+      classRequest &&
+      setup->bRequest == HID_GET_REPORT &&
+      setup->wValue == (HID_REPORT_TYPE_FEATURE << 8)
+      ) {
+      featureReport[0] = hidEndpoint.getScrollResolutionShift() ? 1 : 0;
+      endpoint->sendData(featureReport, sizeof(featureReport), setup->wLength);
+    }
+    else if (
+      classRequest &&
+      setup->bRequest == HID_SET_REPORT &&
+      setup->wValue == (HID_REPORT_TYPE_FEATURE << 8)
+      ) {
+      endpoint->receiveData(this);
     }
     else {
       endpoint->stall();